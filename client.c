@@ -0,0 +1,159 @@
+/*
+    COP 3402 Systems Software
+    PL/0 Compiler Server Client
+    Authored by Caleb Rivera and Matthew Labrada
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_SOCKET "/tmp/pl0.sock"
+#define MAX_OPTIONS_LENGTH 256
+
+char *read_file(FILE *f, long *length);
+int receive(FILE *in, FILE *out, FILE *echo, long size);
+
+int main(int argc, char *argv[])
+{
+  // Same command line as the compiler: options, then the input and output files
+  char options[MAX_OPTIONS_LENGTH] = "";
+  int argi = 1;
+  int streaming = 0, debug_info = 0, object_output = 0;
+  while (argi < argc && argv[argi][0] == '-')
+  {
+    if (strlen(options) + strlen(argv[argi]) + 2 > sizeof(options))
+    {
+      printf("Too many options\n");
+      return 1;
+    }
+    streaming |= strcmp(argv[argi], "-s") == 0;
+    debug_info |= strcmp(argv[argi], "-g") == 0;
+    object_output |= strcmp(argv[argi], "-c") == 0;
+    strcat(options, argv[argi++]);
+    strcat(options, " ");
+  }
+
+  if (argc - argi != 2)
+  {
+    printf("Usage: %s [-x] [-O[level]] [-s] [-p] [-g] [-a] [-j[threads]] [-c] <input file> <output file>\n", argv[0]);
+    return 1;
+  }
+
+  FILE *input_file = fopen(argv[argi], "r");
+  FILE *output_file = fopen(argv[argi + 1], "w");
+
+  if (input_file == NULL)
+  {
+    printf("Error: Could not open input file %s\n", argv[argi]);
+    exit(1);
+  }
+
+  if (output_file == NULL)
+  {
+    printf("Error: Could not open output file %s\n", argv[argi + 1]);
+    exit(1);
+  }
+
+  long length;
+  char *source = read_file(input_file, &length);
+  fclose(input_file);
+
+  // Connect to the server named by PL0_SERVER
+  const char *path = getenv("PL0_SERVER") != NULL ? getenv("PL0_SERVER") : DEFAULT_SOCKET;
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+  {
+    printf("Error: Could not connect to compiler server %s\n", path);
+    exit(1);
+  }
+  FILE *in = fdopen(fd, "r");
+  FILE *out = fdopen(dup(fd), "w");
+
+  fprintf(out, "%s\n%ld\n", options, length);
+  fwrite(source, 1, length, out);
+  fflush(out);
+  free(source);
+
+  int status;
+  long size[3];
+  if (fscanf(in, "%d %ld %ld %ld", &status, &size[0], &size[1], &size[2]) != 4 || fgetc(in) != '\n')
+  {
+    printf("Error: No response from compiler server %s\n", path);
+    exit(1);
+  }
+
+  // The listing goes to the output file and the terminal, the code and map to their usual files
+  receive(in, output_file, stdout, size[0]);
+  fclose(output_file);
+  if (status == 0)
+  {
+    FILE *elf_file = fopen(object_output ? "elf.o" : "elf.txt", "w");
+    FILE *map_file = debug_info ? fopen("elf.map", "w") : NULL;
+    if (elf_file == NULL || (debug_info && map_file == NULL))
+    {
+      printf("Error: Could not open code file\n");
+      exit(1);
+    }
+    receive(in, elf_file, NULL, size[1]);
+    receive(in, map_file, NULL, size[2]);
+    fclose(elf_file);
+    if (map_file != NULL)
+      fclose(map_file);
+  }
+  else
+  {
+    if (streaming) // Same files the compiler would have removed
+      remove("elf.txt");
+    if (debug_info)
+      remove("elf.map");
+  }
+
+  fclose(in);
+  fclose(out);
+  return status;
+}
+
+// Read a whole file into a new buffer
+char *read_file(FILE *f, long *length)
+{
+  long capacity = 4096;
+  char *buffer = malloc(capacity);
+  *length = 0;
+  size_t n;
+  while ((n = fread(buffer + *length, 1, capacity - *length, f)) > 0)
+  {
+    *length += n;
+    if (*length == capacity)
+    {
+      capacity *= 2;
+      buffer = realloc(buffer, capacity);
+    }
+  }
+  return buffer;
+}
+
+// Copy size bytes of the response to out (if given) and echo (if given)
+int receive(FILE *in, FILE *out, FILE *echo, long size)
+{
+  char chunk[8192];
+  while (size > 0)
+  {
+    size_t n = fread(chunk, 1, size < (long)sizeof(chunk) ? size : (long)sizeof(chunk), in);
+    if (n == 0)
+      return 0;
+    if (out != NULL)
+      fwrite(chunk, 1, n, out);
+    if (echo != NULL)
+      fwrite(chunk, 1, n, echo);
+    size -= n;
+  }
+  return 1;
+}
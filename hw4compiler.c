@@ -9,12 +9,28 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(PL0_NO_SIMD)
+#define PL0_X86_SIMD 1 // Build SSE2/AVX2 lexer paths, chosen at runtime
+#include <immintrin.h>
+#endif
 
 #define MAX_IDENTIFIER_LENGTH 11
 #define MAX_NUMBER_LENGTH 5
 #define MAX_BUFFER_LENGTH 1000
-#define MAX_SYMBOL_TABLE_SIZE 500
-#define MAX_INSTRUCTION_LENGTH MAX_SYMBOL_TABLE_SIZE
+#define MAX_OPTIMIZED_LENGTH 20000 // Longest code the whole-program -O2 passes, quadratic in its length, run on
+#define SOURCE_WINDOW_SIZE 65536
+#define LEX_CHUNK_SIZE (1 << 20) // Input bytes per chunk when lexing on parallel threads (-j)
+#define TOKEN_RING_SIZE 4096     // Tokens the pipelined lexer may run ahead of the parser (-p), a power of two
+#define PIPELINE_BATCH 64        // Tokens the pipelined lexer lexes before passing them on
 
 typedef enum
 {
@@ -52,10 +68,26 @@ typedef enum
 
 } token_type;
 
+typedef enum
+{
+  whitespace_class, // Control characters and whitespace
+  digit_class,      // 0-9
+  alnum_class,      // A-Z, a-z, 0-9
+} char_class;
+
+typedef enum
+{
+  unknown_value,  // Nothing is known
+  constant_value, // Known constant
+  copy_value,     // Same as another variable
+} value_kind;
+
 typedef struct
 {
   char lexeme[MAX_BUFFER_LENGTH + 1]; // String representation of token (Ex: "+", "-", "end")
   char value[MAX_BUFFER_LENGTH + 1];  // Value/Type of token
+  int line;                           // Source line of first character
+  int column;                         // Source column of first character
 } token;
 
 typedef struct
@@ -77,24 +109,183 @@ typedef struct
 
 typedef struct
 {
-  int op; // opcode
-  int l;  // L
-  int m;  // M
+  int op;   // opcode
+  int l;    // L
+  int m;    // M
+  int line; // Source line the instruction was generated for
+  int proc; // Procedure the instruction belongs to (index into proc_names)
 } instruction;
 
+typedef struct
+{
+  int kind;     // beginsym, ifsym or whilesym
+  int jx;       // JPC to patch once the nested statement is parsed (if, while)
+  int lx;       // Start of the loop condition (while)
+  int cond_end; // End of the loop condition code (while)
+} open_compound;
+
+typedef struct
+{
+  int m;           // OPR of the operator, or 0 for an open parenthesis
+  int left_start;  // Start of the left operand's code (of the parenthesized expression for 0)
+  int right_start; // Start of the right operand's code
+  int left_value;  // Value of the left operand, in a constant expression
+} pending_operator;
+
+typedef struct
+{
+  int cursor;        // Token cursor at the first token of the block's statement
+  int end_cursor;    // Token cursor where the declaration pass found the statement to end
+  int end_symbol;    // Token the statement is followed by (0 at the end of input)
+  int last_line;     // Line of the token before the statement
+  int jmp_line;      // Line recorded for the block's JMP
+  int level;         // Block level
+  int dx;            // Frame size after the declarations
+  int tx;            // Number of visible symbols
+  symbol *symbols;   // Symbols visible to the statement
+  instruction *code; // Generated JMP, INC, statement and RTN, with addresses local to the block
+  int size;          // Number of generated instructions
+  int failed;        // Set if generation hit an error or disagreed with the declaration pass
+} body_job;
+
+typedef struct
+{
+  char lexeme[MAX_IDENTIFIER_LENGTH + 1]; // Longer lexemes, only ever numbers, are kept as atoi() reads them
+  char value[3];                          // Token type
+  int line;
+  int column;
+} compact_token;
+
+typedef struct
+{
+  unsigned char *text; // Chunk of the input, ending with a newline unless it is the last
+  long length;
+  list *tokens[2];     // Tokens lexed starting outside any comment (0) and inside a block comment (1)
+  int lines[2];        // Newlines in the chunk, as each variant counted them
+  int ends_in_comment[2]; // Set if the variant ends inside a block comment
+  int failed[2];       // Set if the variant hit a lexical error
+} lex_job;
+
+typedef struct
+{
+  int frame;           // Size of the module's main frame
+  int num_externals;   // Procedures the module calls but does not define
+  char (*externals)[MAX_IDENTIFIER_LENGTH + 1];
+  int *external_addr;  // Address index each external resolves to
+  int num_exports;     // Top-level procedures the module defines
+  char (*exports)[MAX_IDENTIFIER_LENGTH + 1];
+  int *export_offset;  // Entry of each export in the procedure section
+  int num_procedure;   // Instructions in the procedure section
+  int num_main;        // Instructions in the main statement section, which follow the procedures
+  instruction *code;   // Both sections
+  char *reloc;         // Relocation of each instruction's M
+} object_module;
+
 list *token_list;                           // Global pointer to list that holds all tokens
-FILE *input_file;                           // Input file pointer
+// Lexer state is per thread, so -j workers can lex chunks of the input at once
+_Thread_local FILE *input_file;             // Input file pointer
+_Thread_local unsigned char source_window[SOURCE_WINDOW_SIZE]; // Buffered input read by the lexer
+_Thread_local int source_pos = 0;           // Index of next unread byte in source window
+_Thread_local int source_len = 0;           // Number of valid bytes in source window
+_Thread_local long window_offset = 0;       // Input offset of source_window[0]
+_Thread_local int source_line = 1;          // Line of next unread input byte
+_Thread_local long line_start = 0;          // Input offset where the current line begins
+_Thread_local int lexeme_line = 0;          // Line of the token being lexed
+_Thread_local int lexeme_column = 0;        // Column of the token being lexed
+_Thread_local int in_block_comment = 0;     // Set while the lexer is inside a block comment
+lex_job *lex_jobs = NULL;                   // Chunks of the input being lexed on parallel threads
+int num_lex_jobs = 0;
+int next_lex_job = 0;                       // Next chunk for a lexing thread to take
+int pipelined = 0;                          // Lex on a thread of its own while parsing (-p)
+int pipeline_running = 0;                   // Set while the parser takes its tokens from the lexer thread
+pthread_t lexer_thread;                     // Thread lexing ahead of the parser
+compact_token token_ring[TOKEN_RING_SIZE];  // Tokens passed from the lexer thread to the parser
+unsigned long ring_head = 0;                // Tokens the parser has taken, written only by the parser
+unsigned long ring_tail = 0;                // Tokens the lexer has added, written only by the lexer thread
+int lexer_done = 0;                         // Set once the lexer thread has added its last token
+int lexer_failed = 0;                       // Set if the lexer thread stopped at a lexical error
+int lexer_stopping = 0;                     // Set to make the lexer thread stop before the end of the input
 FILE *output_file;                          // Output file pointer
-symbol symbol_table[MAX_SYMBOL_TABLE_SIZE]; // Global symbol table
-instruction code[MAX_INSTRUCTION_LENGTH];   // Global code array
-int cx = 0;                                 // Code index
-int tx = 0;                                 // Symbol table index
-int level = -1;                             // Current level
-int dx = 4;                                 // Space for variables
-int prev_tx = 0;                            // Previous symbol table index
+// Parser and code generator state is per thread, so -j workers can generate procedure bodies at once
+_Thread_local symbol *symbol_table = NULL; // Global symbol table
+_Thread_local int symbol_capacity = 0;
+_Thread_local instruction *code = NULL;     // Global code array
+_Thread_local int code_capacity = 0;
+_Thread_local int cx = 0;                   // Code index
+_Thread_local int tx = 0;                   // Symbol table index
+_Thread_local int level = -1;               // Current level
+_Thread_local int dx = 4;                   // Space for variables
+_Thread_local int prev_tx = 0;              // Previous symbol table index
+int extended_isa = 0;                       // Emit fused superinstructions (-x)
+int optimize_level = 0;                     // Optimization level (-O)
+int streaming = 0;                          // Flush finished procedures to the code file (-s)
+_Thread_local int code_base = 0;            // Address index of code[0] once earlier code is flushed
+FILE *elf_file = NULL;                      // Code file written incrementally when streaming
+int *block_jmp = NULL;                      // Address index of each open block's JMP, by level
+long *pending_offset = NULL;                // File offset of each flushed, unpatched block JMP, by level
+int debug_info = 0;                         // Write the code-to-source map elf.map (-g)
+FILE *map_file = NULL;                      // Code-to-source map file
+char (*proc_names)[MAX_IDENTIFIER_LENGTH + 1] = NULL; // Procedure names, main first
+int num_procs = 0;                          // Number of procedures, including main
+int proc_capacity = 0;                      // Entries in each table indexed by procedure
+int level_capacity = 0;                     // Entries in each table indexed by level
+int num_tracked = 0;                        // Variables tracked by constant propagation
+int *tracked_proc = NULL;                   // Procedure each tracked variable is seen from
+int *tracked_l = NULL;                      // L of each tracked variable
+int *tracked_m = NULL;                      // M of each tracked variable
+int *modified = NULL;                       // Triples (procedure, owner, M): the procedure may store into
+int num_modified = 0;                       // variable M of procedure owner's frame, directly or by calls
+int *range_end = NULL;                      // End of the code range replaced from each index, or -1
+int *range_length = NULL;                   // Number of replacement instructions (0 or 1)
+instruction *range_code = NULL;             // Replacement instruction
+int code_table_capacity = 0;                // Entries in each table indexed by instruction or tracked variable
+int *frame_before = NULL;                   // Frame size of each procedure before compaction, 0 if not compacted
+int *frame_after = NULL;                    // Frame size of each procedure after compaction
+int *folded_into = NULL;                    // Procedure whose code each procedure shares, or -1
+int *folded_length = NULL;                  // Instructions removed by folding each procedure
+int analyze = 0;                            // Print the stack and cost analysis (-a)
+int *analysis_depth = NULL;                 // Stack cells in use above the frame base before each instruction, -1 if unreachable
+int *proc_frame = NULL;                     // Frame size (INC M) of each procedure
+int *proc_peak = NULL;                      // Most stack cells each procedure's own frame and operands use
+int *proc_total = NULL;                     // Stack cells a call of each procedure needs with its callees, -1 if it can recurse
+int *proc_cost = NULL;                      // Instructions on each procedure's longest path, callees included
+int *proc_state = NULL;                     // Call graph walk state of each procedure
+_Thread_local int current_proc = 0;         // Procedure whose code is being emitted
+int *proc_parent = NULL;                    // Enclosing procedure of each procedure, -1 for main
+_Thread_local int last_line = 0;            // Line of the most recently consumed token
+int server_mode = 0;                        // Compiling requests for the compiler server (--server)
+jmp_buf compile_abort;                      // Where a failed compile returns to in server mode
+FILE *request_code = NULL;                  // Server worker's code file, reused for every request
+FILE *request_map = NULL;                   // Server worker's map file, reused for every request
+volatile sig_atomic_t server_stopping = 0;  // Set when the server is asked to shut down
+int parallel_threads = 0;                   // Generate procedure bodies on this many threads (-j)
+int object_output = 0;                      // Write a relocatable object to elf.o instead of elf.txt (-c)
+int num_externals = 0;                      // Procedures called but not defined in this module (-c)
+int external_capacity = 0;
+char (*external_names)[MAX_IDENTIFIER_LENGTH + 1] = NULL; // Names of the external procedures
+int *external_proc = NULL;                  // Stub procedure standing in for each external procedure
+int declaring = 0;                          // Only declarations are being parsed (first pass of -j)
+body_job *jobs = NULL;                      // Statement part of each block, by procedure id (-j only)
+int job_capacity = 0;
+int next_job = 0;                           // Next job for a code generation thread to take
+_Thread_local int speculating = 0;          // Errors abandon the parallel attempt instead of being reported
+_Thread_local jmp_buf parallel_abort;       // Where an abandoned parallel attempt returns to
+_Thread_local open_compound *open_statements = NULL; // Compound statements being parsed, innermost last
+_Thread_local int num_open = 0;
+_Thread_local int open_capacity = 0;
+_Thread_local pending_operator *pending = NULL; // Operators and parentheses awaiting operands, innermost last
+_Thread_local int num_pending = 0;
+_Thread_local int pending_capacity = 0;
 
 // Function prototypes
 char peekc();
+int read_char();
+int fill_source();
+int consume_span(char_class cls, char *dest, int capacity);
+void skip_block_comment();
+void skip_line_comment();
+void note_newlines(int start, int end);
+const char *init_lexer_simd();
 void print_both(const char *format, ...);
 void print_source_code();
 void clear_to_index(char *str, int index);
@@ -107,22 +298,49 @@ list *append_token(list *l, token t);
 void add_token(list *l, token t);
 void print_lexeme_table(list *l);
 void print_tokens(list *l);
+int lex_tokens(list *l, int min_tokens);
+int lex_only(int argc, char *argv[]);
+
+// Parallel lexing function prototypes
+void lex_input();
+unsigned char *read_input_file(long *length);
+void lex_chunk(lex_job *job, int variant);
+void *lex_thread(void *arg);
+int lex_in_parallel();
+
+// Pipelined lexing function prototypes
+void start_pipeline();
+void *pipeline_lexer(void *arg);
+int push_token(token *t);
+int pop_token(token *t);
+void finish_pipeline();
 
 // Parser/Codegen function prototypes
 void get_next_token();
 void emit(int op, int l, int m);
+void reserve_code(int count);
+void reset_code_tables();
 void error(int error_code);
+void remove_partial_output();
 int check_symbol_table(char *string, int to_add);
 void add_symbol(int kind, char *name, int val, int level, int addr, int mark);
+void reserve_symbols(int count);
+int new_procedure(char *name, int parent);
+void grow_procedure_tables();
+void grow_level_tables();
 void program();
 void block();
 void const_declaration();
 int var_declaration();
 void statement();
+int statement_head();
+void open_statement(int kind, int jx, int lx, int cond_end);
+int close_statement();
 void condition();
 void expression();
-void term();
-void factor();
+int constant_expression();
+int operator_precedence(int m);
+void push_pending(int m, int left_start, int right_start);
 void print_symbol_table();
 void print_instructions();
 void get_op_name(int op, char *name);
@@ -130,45 +348,195 @@ void get_op_name(int op, char *name);
 // PL/0 Compiler function prototypes
 void procedure();
 void print_elf_file();
+int code_address(int index);
+void patch_block_jump(int jx, int m);
+void flush_code();
+void print_streamed_code();
+void write_code_map(int start, int end);
+void finish_code_map();
+
+// Optimization function prototypes
+void fuse_superinstructions();
+void rotate_loop(int lx, int cond_end);
+void hoist_loop_invariants(int top, int end);
+void emit_arithmetic(int m, int left_start, int right_start);
+void eliminate_common_subexpressions();
+int fold_operation(instruction ir, int a, int b, int *result);
+int tracked_variable(int proc, int l, int m);
+void kill_variable(int v, value_kind kind[], int value[]);
+int static_ancestor(int proc, int l);
+int may_modify(int proc, int owner, int m);
+void find_modified_variables();
+void replace_range(int start, int end, int length, instruction with);
+int apply_replacements();
+int propagate_block(int start, int end, value_kind kind[], int value[], int rewrite);
+int remove_unreachable_code();
+void propagate_constants();
+int accesses_variable(instruction i);
+int next_instructions(int i, int next[2]);
+void compact_frames();
+void print_frame_report();
+int procedure_end(int proc);
+instruction normalized_instruction(int i, int start, int end);
+unsigned int hash_code_range(int start, int end);
+int same_code_range(int a, int b, int length);
+void fold_identical_procedures();
+void print_folding_report();
+
+// Static analysis function prototypes
+int stack_change(instruction ir);
+void measure_procedure(int proc);
+int longest_path(int start, int end, int *bounded);
+void analyze_calls(int proc);
+int calls_reach(int from, int to, char *visited);
+void print_analysis_report();
+
+// Parallel code generation function prototypes
+void reset_parser();
+void block_body();
+void declare_body();
+void generate_body(body_job *job);
+void *generation_thread(void *arg);
+void place_block(int proc, int *next, int *jmp_pos, int *inc_pos, int *order, int *num_ordered);
+void link_bodies();
+int generate_in_parallel();
+
+// Relocatable object and linker function prototypes
+int external_address(char *name);
+int external_index(int proc);
+int exported_procedure(int proc);
+int procedure_entry(int proc);
+int procedure_depth(int proc);
+void emit_external_stubs();
+void write_object(FILE *f);
+int read_object(FILE *f, object_module *module);
+int link_objects(int argc, char *argv[]);
+
+// Compiler server function prototypes
+void fail();
+int parse_options(int argc, char *argv[], int argi);
+void reset_compiler();
+FILE *reset_file(FILE *f);
+int compile_request(char *options, char *source, long length);
+int read_request(FILE *in, char **options, size_t *options_size, char **source, long *capacity, long *length);
+void copy_file(FILE *from, FILE *to);
+void write_response(FILE *out, int status);
+void serve_connection(FILE *in, FILE *out);
+void run_worker(int listen_fd);
+void stop_server(int sig);
+int run_server(int argc, char *argv[]);
 
 int main(int argc, char *argv[])
 {
-  if (argc != 3)
+  if (argc >= 2 && strcmp(argv[1], "--server") == 0)
+    return run_server(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "--link") == 0)
+    return link_objects(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "--lex") == 0)
+    return lex_only(argc - 2, argv + 2);
+
+  int argi = parse_options(argc, argv, 1); // Index of first non-option argument
+  if (argi < argc && argv[argi][0] == '-')
+  {
+    printf("Unknown option %s\n", argv[argi]);
+    return 1;
+  }
+
+  if (argc - argi != 2)
+  {
+    printf("Usage: %s [-x] [-O[level]] [-s] [-p] [-g] [-a] [-j[threads]] [-c] <input file> <output file>\n", argv[0]);
+    printf("       %s --link <code file> <object files>\n", argv[0]);
+    printf("       %s --lex <input file>\n", argv[0]);
+    return 1;
+  }
+
+  if (object_output && streaming)
+  {
+    printf("Error: -c cannot be combined with -s\n");
+    return 1;
+  }
+
+  if (pipelined && parallel_threads > 0)
   {
-    print_both("Usage: %s <input file> <output file>\n", argv[0]);
+    printf("Error: -p cannot be combined with -j\n");
     return 1;
   }
 
-  input_file = fopen(argv[1], "r");
-  output_file = fopen(argv[2], "w");
+  input_file = fopen(argv[argi], "r");
+  output_file = fopen(argv[argi + 1], "w");
 
   if (input_file == NULL)
   {
-    print_both("Error: Could not open input file %s\n", argv[1]);
+    printf("Error: Could not open input file %s\n", argv[argi]);
     exit(1);
   }
 
   if (output_file == NULL)
   {
-    print_both("Error: Could not open output file %s\n", argv[2]);
+    printf("Error: Could not open output file %s\n", argv[argi + 1]);
     exit(1);
   }
 
   token_list = create_list();
+  init_lexer_simd();
+
+  if (streaming)
+  {
+    elf_file = fopen("elf.txt", "w+");
+    if (elf_file == NULL)
+    {
+      printf("Error: Could not open code file elf.txt\n");
+      exit(1);
+    }
+  }
+  if (pipelined)
+    start_pipeline(); // Tokenize on another thread while parsing
+  else if (!streaming || parallel_threads > 0)
+    lex_input(); // Tokenize the entire input before parsing
+
+  if (debug_info)
+  {
+    map_file = fopen("elf.map", "w");
+    if (map_file == NULL)
+    {
+      printf("Error: Could not open map file elf.map\n");
+      exit(1);
+    }
+  }
+
+  // Read in tokens in the tokens list and generate code
+  program();
+
+  destroy_list(token_list); // Free memory used by token list
+  fclose(input_file);       // Close input file
+  fclose(output_file);      // Close output file
+  return 0;
+}
 
+// Tokenize the input file until list l holds at least min_tokens tokens (all tokens if negative).
+// Return 1 if lexing stopped at the end of the input, which a 0xff byte also marks.
+int lex_tokens(list *l, int min_tokens)
+{
   char c;
   char buffer[MAX_BUFFER_LENGTH + 1] = {0};
   int buffer_index = 0;
 
-  while ((c = fgetc(input_file)) != EOF)
+  while (min_tokens < 0 || l->size < min_tokens)
   {
+    if ((c = read_char()) == EOF)
+      return 1;
     if (iscntrl(c) || isspace(c)) // Skip control characters and whitespace
     {
-      c = fgetc(input_file);
+      consume_span(whitespace_class, NULL, 0); // Skip the rest of the run
+      if ((c = read_char()) == EOF)
+        return 1;
     }
+    lexeme_line = source_line; // Remember where the token starts
+    lexeme_column = (int)(window_offset + source_pos - 1 - line_start) + 1;
     if (isdigit(c)) // Handle numbers
     {
       buffer[buffer_index++] = c;
+      buffer_index += consume_span(digit_class, buffer + buffer_index, MAX_BUFFER_LENGTH - buffer_index);
       while (1)
       {
         char nextc = peekc();
@@ -177,7 +545,7 @@ int main(int argc, char *argv[])
           token t;
           if (buffer_index > MAX_NUMBER_LENGTH)
           {
-            exit(1);
+            fail();
             // Number is too long
             // print_both("%10s %20s\n", buffer, "ERROR: NUMBER TOO LONG");
           }
@@ -187,7 +555,7 @@ int main(int argc, char *argv[])
             // print_both("%10s %20d\n", buffer, numbersym);
             sprintf(t.value, "%d", numbersym);
             strcpy(t.lexeme, buffer);
-            append_token(token_list, t);
+            append_token(l, t);
           }
 
           // Clear buffer and break out of loop
@@ -198,7 +566,7 @@ int main(int argc, char *argv[])
         else if (isdigit(nextc))
         {
           // If next character is a digit, add it to the buffer
-          c = getc(input_file);
+          c = read_char();
           buffer[buffer_index++] = c;
         }
         else if (nextc == EOF) // This is the last character in the file
@@ -210,16 +578,19 @@ int main(int argc, char *argv[])
           // print_both("%10s %20d\n", buffer, numbersym);
           sprintf(t.value, "%d", numbersym);
           strcpy(t.lexeme, buffer);
-          append_token(token_list, t);
+          append_token(l, t);
           clear_to_index(buffer, buffer_index);
           buffer_index = 0;
           break;
         }
+        else // Invalid character
+          fail();
       }
     }
     else if (isalpha(c)) // Handle identifiers and reserved words
     {
       buffer[buffer_index++] = c;
+      buffer_index += consume_span(alnum_class, buffer + buffer_index, MAX_BUFFER_LENGTH - buffer_index);
       while (1)
       {
         char nextc = peekc();
@@ -233,7 +604,7 @@ int main(int argc, char *argv[])
             // print_both("%10s %20d\n", buffer, token_value);
             sprintf(t.value, "%d", token_value);
             strcpy(t.lexeme, buffer);
-            append_token(token_list, t);
+            append_token(l, t);
             clear_to_index(buffer, buffer_index);
             buffer_index = 0;
             break;
@@ -244,7 +615,7 @@ int main(int argc, char *argv[])
             token t;
             if (buffer_index > MAX_IDENTIFIER_LENGTH) // Check if identifier is too long
             {
-              exit(1);
+              fail();
               // print_both("%10s %20s\n", buffer, "ERROR: IDENTIFIER TOO LONG");
             }
             else
@@ -253,7 +624,7 @@ int main(int argc, char *argv[])
               // print_both("%10s %20d\n", buffer, identsym);
               sprintf(t.value, "%d", identsym);
               strcpy(t.lexeme, buffer);
-              append_token(token_list, t);
+              append_token(l, t);
             }
 
             clear_to_index(buffer, buffer_index);
@@ -264,9 +635,11 @@ int main(int argc, char *argv[])
         }
         else if (isalnum(nextc)) // If next character is a letter or digit, add it to the buffer
         {
-          c = getc(input_file);
+          c = read_char();
           buffer[buffer_index++] = c;
         }
+        else // Invalid character
+          fail();
       }
     }
     else if (is_special_symbol(c)) // Handle special symbols
@@ -282,16 +655,7 @@ int main(int argc, char *argv[])
           // Clear buffer
           clear_to_index(buffer, buffer_index);
           buffer_index = 0;
-          while (1) // Consume characters until we reach the end of the block comment
-          {
-            c = getc(input_file);
-            nextc = peekc();
-            if (c == '*' && nextc == '/')
-            {
-              c = getc(input_file);
-              break;
-            }
-          }
+          skip_block_comment(); // Consume characters until we reach the end of the block comment
           continue;
         }
 
@@ -301,38 +665,26 @@ int main(int argc, char *argv[])
           // Clear buffer
           clear_to_index(buffer, buffer_index);
           buffer_index = 0;
-          while (1) // Consume characters until we reach the end of the line
-          {
-            c = getc(input_file);
-            nextc = peekc();
-            if (c == '\n')
-            {
-              break;
-            }
-          }
+          skip_line_comment(); // Consume characters until we reach the end of the line
           continue;
         }
 
-        // Handle special case where the second symbol is a semicolon
-        if (nextc == ';')
+        // Handle special case where the second symbol is a semicolon, or a comma after a constant's
+        // initializer
+        if (nextc == ';' || nextc == ',')
         {
           // Check if first symbol is a valid symbol
           token t;
           int token_value = handle_special_symbol(buffer);
           if (!token_value)
           {
-            exit(1);
+            fail();
           }
 
-          // Append first symbol to token list
+          // Append first symbol to token list. The second is read next as a token of its own.
           sprintf(t.value, "%d", token_value);
           strcpy(t.lexeme, buffer);
-          append_token(token_list, t);
-
-          // Append semicolon to token list
-          sprintf(t.value, "%d", semicolonsym);
-          strcpy(t.lexeme, ";");
-          append_token(token_list, t);
+          append_token(l, t);
 
           clear_to_index(buffer, buffer_index);
           buffer_index = 0;
@@ -341,7 +693,7 @@ int main(int argc, char *argv[])
         }
 
         // We have two pontentially valid symbols, so we need to check if they make a valid symbol
-        c = getc(input_file);
+        c = read_char();
         buffer[buffer_index++] = c;
 
         token t;
@@ -351,7 +703,7 @@ int main(int argc, char *argv[])
           // All symbols are invalid
           // for (int i = 0; i < buffer_index; i++)
           //   print_both("%10c %20s\n", buffer[i], "ERROR: INVALID SYMBOL");
-          exit(1);
+          fail();
         }
         else
         {
@@ -359,7 +711,7 @@ int main(int argc, char *argv[])
           // print_both("%10s %20d\n", buffer, token_value);
           sprintf(t.value, "%d", token_value);
           strcpy(t.lexeme, buffer);
-          append_token(token_list, t);
+          append_token(l, t);
         }
 
         clear_to_index(buffer, buffer_index);
@@ -372,7 +724,7 @@ int main(int argc, char *argv[])
         int token_value = handle_special_symbol(buffer);
         if (!token_value)
         {
-          exit(1);
+          fail();
           // print_both("%10c %20s\n", c, "ERROR: INVALID SYMBOL");
         }
         else
@@ -380,7 +732,7 @@ int main(int argc, char *argv[])
           // print_both("%10s %20d\n", buffer, token_value);
           sprintf(t.value, "%d", token_value);
           strcpy(t.lexeme, buffer);
-          append_token(token_list, t);
+          append_token(l, t);
         }
 
         clear_to_index(buffer, buffer_index);
@@ -388,31 +740,60 @@ int main(int argc, char *argv[])
       }
     }
   }
-
-  // Read in tokens in the tokens list and generate code
-  program();
-
-  destroy_list(token_list); // Free memory used by token list
-  fclose(input_file);       // Close input file
-  fclose(output_file);      // Close output file
   return 0;
 }
 
 // Peek at the next character from the input file without consuming it
 char peekc()
 {
-  int c = getc(input_file);
-  ungetc(c, input_file);
-  return (char)c;
+  if (source_pos == source_len && fill_source() == 0)
+    return (char)EOF;
+  return (char)source_window[source_pos];
+}
+
+// Read the next character from the input file
+int read_char()
+{
+  if (source_pos == source_len && fill_source() == 0)
+    return EOF;
+  if (source_window[source_pos] == '\n')
+    note_newlines(source_pos, source_pos + 1);
+  return source_window[source_pos++];
+}
+
+// Advance the line count past the newlines in source_window[start..end)
+void note_newlines(int start, int end)
+{
+  unsigned char *p = source_window + start;
+  while ((p = memchr(p, '\n', source_window + end - p)) != NULL)
+  {
+    source_line++;
+    line_start = window_offset + (p - source_window) + 1;
+    p++;
+  }
+}
+
+// Move unread bytes to the front of the source window and read more input after them
+int fill_source()
+{
+  int unread = source_len - source_pos;
+  window_offset += source_pos;
+  memmove(source_window, source_window + source_pos, unread);
+  source_pos = 0;
+  source_len = unread + fread(source_window + unread, 1, SOURCE_WINDOW_SIZE - unread, input_file);
+  return source_len;
 }
 
 // Print formatted output to both the console and the output file
 void print_both(const char *format, ...)
 {
   va_list args;
-  va_start(args, format);
-  vprintf(format, args);
-  va_end(args);
+  if (!server_mode) // The server sends the listing back instead
+  {
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+  }
 
   va_start(args, format);
   vfprintf(output_file, format, args);
@@ -542,678 +923,4132 @@ int is_special_symbol(char c)
           c == '|');
 }
 
-// Create and initialize new list for storing tokens
-list *create_list()
+// Check if a byte belongs to a character class, matching the ctype checks in the C locale
+int in_class(unsigned char c, char_class cls)
 {
-  list *l = malloc(sizeof(list));
-  l->size = 0;
-  l->capacity = 10;
-  l->tokens = malloc(sizeof(token) * l->capacity);
-  return l;
+  if (cls == whitespace_class)
+    return c <= ' ' || c == 127;
+  if (cls == digit_class)
+    return c >= '0' && c <= '9';
+  return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
 }
 
-// Free the memory used by a list and its tokens
-list *destroy_list(list *l)
+// Return the length of the run of bytes in class at the start of p[0..n)
+int span_class_scalar(const unsigned char *p, int n, char_class cls)
 {
-  free(l->tokens);
-  free(l);
-  return NULL;
+  int i = 0;
+  while (i < n && in_class(p[i], cls))
+    i++;
+  return i;
 }
 
-// Append a token to a list, resizing the list if necessary
-list *append_token(list *l, token t)
+// Return the index of the "*/" that ends a block comment in p[0..n), or -1
+int find_comment_end_scalar(const unsigned char *p, int n)
 {
-  if (l->size == l->capacity)
+  for (int i = 0; i + 1 < n; i++)
+    if (p[i] == '*' && p[i + 1] == '/')
+      return i;
+  return -1;
+}
+
+// Return the index of the first newline in p[0..n), or -1
+int find_newline_scalar(const unsigned char *p, int n)
+{
+  for (int i = 0; i < n; i++)
+    if (p[i] == '\n')
+      return i;
+  return -1;
+}
+
+#ifdef PL0_X86_SIMD
+// Set each byte of the result to 0xFF where the byte of v is in class
+__attribute__((target("sse2"))) static inline __m128i class_mask_sse2(__m128i v, char_class cls)
+{
+  __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit); // Unsigned v - '0' <= 9
+  if (cls == whitespace_class)
+    return _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(' ')), v),
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8(127)));
+  if (cls == digit_class)
+    return digit;
+  __m128i alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(25)), alpha); // Unsigned (v | 0x20) - 'a' <= 25
+  return _mm_or_si128(digit, alpha);
+}
+
+__attribute__((target("sse2"))) int span_class_sse2(const unsigned char *p, int n, char_class cls)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
   {
-    l->capacity *= 2;
-    l->tokens = realloc(l->tokens, sizeof(token) * l->capacity);
+    unsigned mask = _mm_movemask_epi8(class_mask_sse2(_mm_loadu_si128((const __m128i *)(p + i)), cls));
+    if (mask != 0xFFFF)
+      return i + __builtin_ctz(~mask);
   }
-  l->tokens[l->size++] = t;
-  return l;
+  return i + span_class_scalar(p + i, n - i, cls);
 }
 
-// Add a token to a list, resizing the list if necessary
-void add_token(list *l, token t)
+__attribute__((target("sse2"))) int find_comment_end_sse2(const unsigned char *p, int n)
 {
-  if (l->size == l->capacity)
+  int i = 0;
+  for (; i + 17 <= n; i += 16)
   {
-    l->capacity *= 2;
-    l->tokens = realloc(l->tokens, sizeof(token) * l->capacity);
+    __m128i star = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), _mm_set1_epi8('*'));
+    __m128i slash = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 1)), _mm_set1_epi8('/'));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(star, slash));
+    if (mask)
+      return i + __builtin_ctz(mask);
   }
-  l->tokens[l->size++] = t;
+  int j = find_comment_end_scalar(p + i, n - i);
+  return j < 0 ? -1 : i + j;
 }
 
-// Print the lexeme table to both the console and output file
-void print_lexeme_table(list *l)
+__attribute__((target("sse2"))) int find_newline_sse2(const unsigned char *p, int n)
 {
-  for (int i = 0; i < l->size; i++)
-    print_both("%10s %20s\n", l->tokens[i].lexeme, l->tokens[i].value);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), _mm_set1_epi8('\n')));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  int j = find_newline_scalar(p + i, n - i);
+  return j < 0 ? -1 : i + j;
 }
 
-// Print the tokens to both the console and output file
-void print_tokens(list *l)
+// AVX2 versions of the above, 32 bytes at a time
+__attribute__((target("avx2"))) static inline __m256i class_mask_avx2(__m256i v, char_class cls)
 {
-  int counter; // Counter to keep track of the number of tokens printed for sake of ommitting extra new line character at end of file
+  __m256i digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+  digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+  if (cls == whitespace_class)
+    return _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(' ')), v),
+                           _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127)));
+  if (cls == digit_class)
+    return digit;
+  __m256i alpha = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+  alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(25)), alpha);
+  return _mm256_or_si256(digit, alpha);
+}
 
-  for (int i = 0; i < l->size; i++)
+__attribute__((target("avx2"))) int span_class_avx2(const unsigned char *p, int n, char_class cls)
+{
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
   {
-    print_both("%s ", l->tokens[i].value);
-    char identifier_value[3] = {0}, number_value[3] = {0};
-    sprintf(identifier_value, "%d", identsym);
-    sprintf(number_value, "%d", numbersym);
-
-    // Check if the token value matches identifier or number and print its lexeme
-    if (strcmp(l->tokens[i].value, identifier_value) == 0 || strcmp(l->tokens[i].value, number_value) == 0)
-      print_both("%s ", l->tokens[i].lexeme);
-    counter++;
+    unsigned mask = _mm256_movemask_epi8(class_mask_avx2(_mm256_loadu_si256((const __m256i *)(p + i)), cls));
+    if (mask != 0xFFFFFFFFu)
+      return i + __builtin_ctz(~mask);
   }
+  return i + span_class_sse2(p + i, n - i, cls);
+}
 
-  // Print a newline if we haven't reached the last token
-  if (counter < l->size - 1)
+__attribute__((target("avx2"))) int find_comment_end_avx2(const unsigned char *p, int n)
+{
+  int i = 0;
+  for (; i + 33 <= n; i += 32)
   {
-    print_both("\n");
+    __m256i star = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), _mm256_set1_epi8('*'));
+    __m256i slash = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 1)), _mm256_set1_epi8('/'));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(star, slash));
+    if (mask)
+      return i + __builtin_ctz(mask);
   }
+  int j = find_comment_end_sse2(p + i, n - i);
+  return j < 0 ? -1 : i + j;
 }
 
-// Parser/Codegen stuff
-token current_token; // Keep track of current token
-
-// Get next token from token list
-void get_next_token()
+__attribute__((target("avx2"))) int find_newline_avx2(const unsigned char *p, int n)
 {
-  current_token = token_list->tokens[0];
-  for (int i = 0; i < token_list->size - 1; i++)
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
   {
-    token_list->tokens[i] = token_list->tokens[i + 1];
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), _mm256_set1_epi8('\n')));
+    if (mask)
+      return i + __builtin_ctz(mask);
   }
-  token_list->size--;
+  int j = find_newline_sse2(p + i, n - i);
+  return j < 0 ? -1 : i + j;
 }
+#endif
 
-// Emit an instruction to the code array
-void emit(int op, int l, int m)
+// Scanning routines used by the lexer, chosen for the running CPU by init_lexer_simd()
+int (*span_class)(const unsigned char *p, int n, char_class cls) = span_class_scalar;
+int (*find_comment_end)(const unsigned char *p, int n) = find_comment_end_scalar;
+int (*find_newline)(const unsigned char *p, int n) = find_newline_scalar;
+
+// Select the widest scanning routines the CPU supports and return their name
+const char *init_lexer_simd()
 {
-  if (cx > MAX_INSTRUCTION_LENGTH)
+#ifdef PL0_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
   {
-    error(16);
+    span_class = span_class_avx2;
+    find_comment_end = find_comment_end_avx2;
+    find_newline = find_newline_avx2;
+    return "AVX2";
   }
-  else
+  else if (__builtin_cpu_supports("sse2"))
   {
-    code[cx].op = op;
-    code[cx].l = l;
-    code[cx].m = m;
-    cx++;
+    span_class = span_class_sse2;
+    find_comment_end = find_comment_end_sse2;
+    find_newline = find_newline_sse2;
+    return "SSE2";
   }
+#endif
+  return "scalar";
 }
 
-// Print an error message and exit
-void error(int error_code)
+// Consume the run of input bytes in class, copying up to capacity of them into dest (if given)
+int consume_span(char_class cls, char *dest, int capacity)
 {
-  print_both("Error: ");
-  switch (error_code)
+  int total = 0;
+  while (source_pos < source_len || fill_source() > 0)
   {
-  case 1:
-    print_both("program must end with a period\n");
-    break;
-  case 2:
-    print_both("const, var, and procedure keywords must be followed by identifier\n");
-    break;
-  case 3:
-    print_both("symbol name has already been declared\n");
-    break;
-  case 4:
-    print_both("constants must be assigned with =\n");
-    break;
-  case 5:
-    print_both("constants must be assigned an integer value\n");
-    break;
-  case 6:
-    print_both("constant, variables, and procedure declarations must be followed by a semicolon\n");
-    break;
-  case 7:
-    print_both("undeclared or out of scope identifier %s\n", current_token.lexeme);
-    break;
-  case 8:
-    print_both("only variable values may be altered\n");
-    break;
-  case 9:
-    print_both("assignment statements must use :=\n");
-    break;
-  case 10:
-    print_both("begin must be followed by end\n");
-    break;
-  case 11:
-    print_both("if must be followed by then\n");
-    break;
-  case 12:
-    print_both("while must be followed by do\n");
-    break;
-  case 13:
-    print_both("condition must contain comparison operator\n");
-    break;
-  case 14:
-    print_both("right parenthesis must follow left parenthesis\n");
-    break;
-  case 15:
-    print_both("arithmetic equations must contain operands, parenthesis, numbers, or symbols\n");
-    break;
-  case 16:
-    print_both("program too long\n");
-    break;
-  case 17:
-    print_both("call must be followed by an identifier\n");
-    break;
-  case 18:
-    print_both("cannot call variable or constant\n");
-    break;
+    int n = span_class(source_window + source_pos, source_len - source_pos, cls);
+    if (cls == whitespace_class)
+      note_newlines(source_pos, source_pos + n);
+    if (dest != NULL)
+    {
+      if (total + n > capacity) // Longer than any valid token
+        fail();
+      memcpy(dest + total, source_window + source_pos, n);
+    }
+    source_pos += n;
+    total += n;
+    if (source_pos < source_len) // Run ended inside the window
+      break;
   }
-
-  exit(1);
+  return total;
 }
 
-// Find a symbol in the symbol table
-int check_symbol_table(char *string, int to_add)
+// Consume input up to and including the "*/" that ends a block comment
+void skip_block_comment()
 {
-  for (int i = tx - 1; i >= 0; i--)
+  in_block_comment = 1;
+  while (source_len - source_pos >= 2 || fill_source() >= 2)
   {
-    if (to_add && strcmp(string, symbol_table[i].name) == 0 && level == symbol_table[i].level)
+    int i = find_comment_end(source_window + source_pos, source_len - source_pos);
+    if (i >= 0)
     {
-      return i;
+      note_newlines(source_pos, source_pos + i + 2);
+      source_pos += i + 2;
+      in_block_comment = 0;
+      return;
     }
-    else if (!to_add && strcmp(string, symbol_table[i].name) == 0 && symbol_table[i].level <= level)
+    note_newlines(source_pos, source_len - 1);
+    source_pos = source_len - 1; // Keep the last byte, it may be the '*' of a "*/" split across reads
+    if (fill_source() < 2)
+      break;
+  }
+  note_newlines(source_pos, source_len);
+  source_pos = source_len; // Unterminated comment runs to the end of the input
+}
+
+// Consume input up to and including the next newline
+void skip_line_comment()
+{
+  while (source_pos < source_len || fill_source() > 0)
+  {
+    int i = find_newline(source_window + source_pos, source_len - source_pos);
+    if (i >= 0)
     {
-      return i;
+      note_newlines(source_pos, source_pos + i + 1);
+      source_pos += i + 1;
+      return;
     }
+    source_pos = source_len;
   }
-  return -1;
 }
 
-// Add a symbol to the symbol table
-void add_symbol(int kind, char *name, int val, int level, int addr, int mark)
+// Tokenize the whole input into token_list, splitting it among the -j threads when it is large
+void lex_input()
 {
-  symbol_table[tx].kind = kind;
-  strcpy(symbol_table[tx].name, name);
-  symbol_table[tx].val = val;
-  symbol_table[tx].level = level;
-  symbol_table[tx].addr = addr;
-  symbol_table[tx].mark = mark;
-  tx++;
+  if (parallel_threads == 0 || !lex_in_parallel())
+    lex_tokens(token_list, -1);
 }
 
-// Parse the program
-void program()
+// Lex the input file named by argv[0] a batch of tokens at a time, without parsing it or writing a
+// listing, and print the number of tokens. This times the lexer on its own (--lex).
+int lex_only(int argc, char *argv[])
 {
+  if (argc != 1)
+  {
+    printf("Usage: --lex <input file>\n");
+    return 1;
+  }
+  input_file = fopen(argv[0], "r");
+  if (input_file == NULL)
+  {
+    printf("Error: Could not open input file %s\n", argv[0]);
+    return 1;
+  }
+
+  const char *routines = init_lexer_simd();
+  list *batch = create_list();
+  long count = 0;
+  int ended = 0;
+  while (!ended)
+  {
+    batch->size = 0;
+    ended = lex_tokens(batch, PIPELINE_BATCH);
+    count += batch->size;
+  }
+  printf("%ld tokens, %s lexer\n", count, routines);
+  destroy_list(batch);
+  fclose(input_file);
+  return 0;
+}
+
+// Read the rest of the input file into a new buffer, returning NULL if memory runs out
+unsigned char *read_input_file(long *length)
+{
+  long capacity = SOURCE_WINDOW_SIZE;
+  unsigned char *text = malloc(capacity);
+  *length = 0;
+  size_t n;
+  while (text != NULL && (n = fread(text + *length, 1, capacity - *length, input_file)) > 0)
+  {
+    *length += n;
+    if (*length == capacity)
+    {
+      capacity *= 2;
+      unsigned char *grown = realloc(text, capacity);
+      if (grown == NULL)
+        free(text);
+      text = grown;
+    }
+  }
+  return text;
+}
+
+// Lex one chunk of the input on this thread, starting outside any comment (variant 0) or inside
+// a block comment (variant 1). A lexical error marks the variant failed instead of stopping.
+void lex_chunk(lex_job *job, int variant)
+{
+  speculating = 1;
+  job->tokens[variant] = create_list();
+  input_file = fmemopen(job->text, job->length, "r");
+  if (input_file == NULL)
+  {
+    job->failed[variant] = 1;
+    return;
+  }
+  source_pos = source_len = 0;
+  window_offset = line_start = 0; // The chunk starts a line
+  source_line = 1;
+  in_block_comment = 0;
+  if (setjmp(parallel_abort) == 0)
+  {
+    if (variant == 1)
+      skip_block_comment();
+    lex_tokens(job->tokens[variant], -1);
+    job->lines[variant] = source_line - 1;
+    job->ends_in_comment[variant] = in_block_comment;
+  }
+  else
+    job->failed[variant] = 1;
+  fclose(input_file);
+}
+
+// Take chunks in turn and lex each for both states the previous chunk may leave the lexer in
+void *lex_thread(void *arg)
+{
+  for (int k = __atomic_fetch_add(&next_lex_job, 1, __ATOMIC_RELAXED); k < num_lex_jobs;
+       k = __atomic_fetch_add(&next_lex_job, 1, __ATOMIC_RELAXED))
+  {
+    lex_chunk(&lex_jobs[k], 0);
+    if (k > 0) // The first chunk starts outside any comment
+      lex_chunk(&lex_jobs[k], 1);
+  }
+  return arg;
+}
+
+// Split the input into chunks that each end with a newline and lex them on parallel threads. A
+// chunk boundary can only fall outside any comment or inside a block comment, since a line comment
+// ends at the newline, so each chunk is lexed speculatively for both. The chunks are then walked in
+// order, each one's result picked by the state the one before it ended in, and its tokens appended
+// with their lines moved past the earlier chunks. Return 0, leaving the input to be lexed serially,
+// if the input is too small to split or holds a byte the serial lexer would take for end of input.
+int lex_in_parallel()
+{
+  long length;
+  unsigned char *text = read_input_file(&length);
+  if (text == NULL || length < 2 * LEX_CHUNK_SIZE || memchr(text, (unsigned char)EOF, length) != NULL)
+  {
+    free(text);
+    rewind(input_file);
+    return 0;
+  }
+
+  lex_jobs = calloc(length / LEX_CHUNK_SIZE + 1, sizeof(lex_job));
+  num_lex_jobs = next_lex_job = 0;
+  for (long start = 0; start < length;)
+  {
+    long end = start + LEX_CHUNK_SIZE < length ? start + LEX_CHUNK_SIZE : length;
+    unsigned char *newline = memchr(text + end - 1, '\n', length - end + 1);
+    end = newline != NULL ? newline - text + 1 : length;
+    lex_jobs[num_lex_jobs].text = text + start;
+    lex_jobs[num_lex_jobs++].length = end - start;
+    start = end;
+  }
+
+  int num_threads = parallel_threads < num_lex_jobs ? parallel_threads : num_lex_jobs;
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  int started = 0;
+  while (started < num_threads && pthread_create(&threads[started], NULL, lex_thread, NULL) == 0)
+    started++;
+  if (started == 0)
+  {
+    FILE *f = input_file;
+    lex_thread(NULL); // Lex every chunk on this thread
+    input_file = f;
+  }
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  int state = 0, line_offset = 0, failed = 0;
+  for (int k = 0; k < num_lex_jobs; k++)
+  {
+    lex_job *job = &lex_jobs[k];
+    if (!failed && job->failed[state])
+      failed = 1; // The serial lexer stops here too
+    for (int i = 0; !failed && i < job->tokens[state]->size; i++)
+    {
+      token t = job->tokens[state]->tokens[i];
+      t.line += line_offset;
+      add_token(token_list, t);
+    }
+    line_offset += job->lines[state];
+    state = job->ends_in_comment[state];
+    for (int v = 0; v < 2; v++)
+      if (job->tokens[v] != NULL)
+        destroy_list(job->tokens[v]);
+  }
+  free(lex_jobs);
+  free(text);
+  speculating = 0;
+  if (failed)
+    fail();
+  return 1;
+}
+
+// Start lexing the input on a thread of its own, ahead of the parser
+void start_pipeline()
+{
+  ring_head = ring_tail = 0;
+  lexer_done = lexer_failed = lexer_stopping = 0;
+  if (pthread_create(&lexer_thread, NULL, pipeline_lexer, input_file) != 0)
+  {
+    lex_input(); // Tokenize the entire input before parsing instead
+    return;
+  }
+  pipeline_running = 1;
+}
+
+// Lex the input a batch at a time, passing the tokens to the parser through the token ring
+void *pipeline_lexer(void *arg)
+{
+  input_file = arg;
+  speculating = 1; // A lexical error stops this thread instead of the compiler
+  list *batch = create_list();
+  if (setjmp(parallel_abort) == 0)
+  {
+    int ended = 0, stopped = 0;
+    while (!ended && !stopped)
+    {
+      batch->size = 0;
+      ended = lex_tokens(batch, PIPELINE_BATCH); // Input past a 0xff byte is never lexed
+      for (int i = 0; i < batch->size && !stopped; i++)
+        stopped = !push_token(&batch->tokens[i]);
+    }
+  }
+  else
+  {
+    for (int i = 0; i < batch->size && push_token(&batch->tokens[i]); i++) // Tokens before the error
+      ;
+    lexer_failed = 1;
+  }
+  destroy_list(batch);
+  __atomic_store_n(&lexer_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Add a token to the ring, waiting while the parser is a full ring behind. Only the lexer thread
+// writes ring_tail and only the parser writes ring_head, so no lock is needed. Return 0 if the
+// parser no longer wants tokens.
+int push_token(token *t)
+{
+  unsigned long tail = ring_tail;
+  while (tail - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == TOKEN_RING_SIZE)
+  {
+    if (__atomic_load_n(&lexer_stopping, __ATOMIC_ACQUIRE))
+      return 0;
+    sched_yield();
+  }
+
+  compact_token *slot = &token_ring[tail & (TOKEN_RING_SIZE - 1)];
+  if (strlen(t->lexeme) > MAX_IDENTIFIER_LENGTH) // Only a number run into letters gets this long
+    snprintf(slot->lexeme, sizeof(slot->lexeme), "%d", atoi(t->lexeme));
+  else
+    strcpy(slot->lexeme, t->lexeme);
+  strcpy(slot->value, t->value);
+  slot->line = t->line;
+  slot->column = t->column;
+  __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Take the next token from the ring, waiting for the lexer if it is empty. Return 0 once the lexer
+// has finished and every token has been taken.
+int pop_token(token *t)
+{
+  unsigned long head = ring_head;
+  while (head == __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE))
+  {
+    if (__atomic_load_n(&lexer_done, __ATOMIC_ACQUIRE) && head == __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE))
+      return 0;
+    sched_yield();
+  }
+
+  compact_token *slot = &token_ring[head & (TOKEN_RING_SIZE - 1)];
+  strcpy(t->lexeme, slot->lexeme);
+  strcpy(t->value, slot->value);
+  t->line = slot->line;
+  t->column = slot->column;
+  __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Stop taking tokens from the lexer thread. Without -s, let it finish the input, dropping the tokens
+// the parser did not take, and stop without a message if it hit a lexical error, as the compiler does
+// when it lexes everything first. With -s, the input past the parser was never lexed, so stop it.
+void finish_pipeline()
+{
+  token t;
+  pipeline_running = 0;
+  if (streaming)
+    __atomic_store_n(&lexer_stopping, 1, __ATOMIC_RELEASE);
+  else
+    while (pop_token(&t))
+      ;
+  pthread_join(lexer_thread, NULL);
+  if (lexer_failed && !streaming)
+  {
+    fail();
+  }
+}
+
+// Create and initialize new list for storing tokens
+list *create_list()
+{
+  list *l = malloc(sizeof(list));
+  l->size = 0;
+  l->capacity = 10;
+  l->tokens = malloc(sizeof(token) * l->capacity);
+  return l;
+}
+
+// Free the memory used by a list and its tokens
+list *destroy_list(list *l)
+{
+  free(l->tokens);
+  free(l);
+  return NULL;
+}
+
+// Append a token to a list, resizing the list if necessary, and stamp it with the lexeme position
+list *append_token(list *l, token t)
+{
+  t.line = lexeme_line;
+  t.column = lexeme_column;
+  if (l->size == l->capacity)
+  {
+    l->capacity *= 2;
+    l->tokens = realloc(l->tokens, sizeof(token) * l->capacity);
+  }
+  l->tokens[l->size++] = t;
+  return l;
+}
+
+// Add a token to a list, resizing the list if necessary
+void add_token(list *l, token t)
+{
+  if (l->size == l->capacity)
+  {
+    l->capacity *= 2;
+    l->tokens = realloc(l->tokens, sizeof(token) * l->capacity);
+  }
+  l->tokens[l->size++] = t;
+}
+
+// Print the lexeme table to both the console and output file
+void print_lexeme_table(list *l)
+{
+  for (int i = 0; i < l->size; i++)
+    print_both("%10s %20s\n", l->tokens[i].lexeme, l->tokens[i].value);
+}
+
+// Print the tokens to both the console and output file
+void print_tokens(list *l)
+{
+  int counter; // Counter to keep track of the number of tokens printed for sake of ommitting extra new line character at end of file
+
+  for (int i = 0; i < l->size; i++)
+  {
+    print_both("%s ", l->tokens[i].value);
+    char identifier_value[3] = {0}, number_value[3] = {0};
+    sprintf(identifier_value, "%d", identsym);
+    sprintf(number_value, "%d", numbersym);
+
+    // Check if the token value matches identifier or number and print its lexeme
+    if (strcmp(l->tokens[i].value, identifier_value) == 0 || strcmp(l->tokens[i].value, number_value) == 0)
+      print_both("%s ", l->tokens[i].lexeme);
+    counter++;
+  }
+
+  // Print a newline if we haven't reached the last token
+  if (counter < l->size - 1)
+  {
+    print_both("\n");
+  }
+}
+
+// Parser/Codegen stuff
+_Thread_local token current_token;          // Keep track of current token
+_Thread_local int token_cursor = 0;         // Index in token_list of the next token to consume
+
+// Get next token from token list
+void get_next_token()
+{
+  last_line = current_token.line;
+  if (pipeline_running)
+  {
+    if (!pop_token(&current_token))
+    {
+      if (lexer_failed) // The lexical error comes before anything the parser could report
+      {
+        pipeline_running = 0;
+        pthread_join(lexer_thread, NULL);
+        fail();
+      }
+      strcpy(current_token.lexeme, ""); // End of input
+      sprintf(current_token.value, "%d", 0);
+    }
+    return;
+  }
+  if (streaming && parallel_threads == 0 && token_cursor == token_list->size)
+  {
+    token_list->size = token_cursor = 0; // Drop consumed tokens
+    lex_tokens(token_list, 1);           // Tokenize on demand so only a few tokens are held at once
+  }
+  if (token_cursor == token_list->size)
+  {
+    strcpy(current_token.lexeme, ""); // End of input
+    sprintf(current_token.value, "%d", 0);
+    return;
+  }
+  current_token = token_list->tokens[token_cursor++];
+}
+
+// Emit an instruction to the code array
+void emit(int op, int l, int m)
+{
+  reserve_code(cx + 1);
+  code[cx].op = op;
+  code[cx].l = l;
+  code[cx].m = m;
+  code[cx].line = last_line ? last_line : current_token.line;
+  code[cx].proc = current_proc;
+  cx++;
+}
+
+// Make room for count instructions in this thread's code array
+void reserve_code(int count)
+{
+  if (count <= code_capacity)
+    return;
+  while (code_capacity < count)
+    code_capacity = code_capacity == 0 ? 512 : code_capacity * 2;
+  code = realloc(code, sizeof(instruction) * code_capacity);
+}
+
+// Size the tables indexed by instruction or tracked variable for the code array, with no code
+// range marked for replacement
+void reset_code_tables()
+{
+  if (code_table_capacity < cx + 1)
+  {
+    code_table_capacity = cx + 1;
+    tracked_proc = realloc(tracked_proc, sizeof(int) * code_table_capacity);
+    tracked_l = realloc(tracked_l, sizeof(int) * code_table_capacity);
+    tracked_m = realloc(tracked_m, sizeof(int) * code_table_capacity);
+    range_end = realloc(range_end, sizeof(int) * code_table_capacity);
+    range_length = realloc(range_length, sizeof(int) * code_table_capacity);
+    range_code = realloc(range_code, sizeof(instruction) * code_table_capacity);
+    analysis_depth = realloc(analysis_depth, sizeof(int) * code_table_capacity);
+  }
+  for (int i = 0; i < cx; i++)
+    range_end[i] = -1;
+}
+
+// Print an error message and exit
+void error(int error_code)
+{
+  if (speculating) // The serial compiler will report it
+    longjmp(parallel_abort, 1);
+  if (pipeline_running) // Without -s, a lexical error later in the input takes precedence
+    finish_pipeline();
+
+  print_both("Error: ");
+  switch (error_code)
+  {
+  case 1:
+    print_both("program must end with a period\n");
+    break;
+  case 2:
+    print_both("const, var, and procedure keywords must be followed by identifier\n");
+    break;
+  case 3:
+    print_both("symbol name has already been declared\n");
+    break;
+  case 4:
+    print_both("constants must be assigned with =\n");
+    break;
+  case 5:
+    print_both("constants must be assigned an integer value\n");
+    break;
+  case 6:
+    print_both("constant, variables, and procedure declarations must be followed by a semicolon\n");
+    break;
+  case 7:
+    print_both("undeclared or out of scope identifier %s\n", current_token.lexeme);
+    break;
+  case 8:
+    print_both("only variable values may be altered\n");
+    break;
+  case 9:
+    print_both("assignment statements must use :=\n");
+    break;
+  case 10:
+    print_both("begin must be followed by end\n");
+    break;
+  case 11:
+    print_both("if must be followed by then\n");
+    break;
+  case 12:
+    print_both("while must be followed by do\n");
+    break;
+  case 13:
+    print_both("condition must contain comparison operator\n");
+    break;
+  case 14:
+    print_both("right parenthesis must follow left parenthesis\n");
+    break;
+  case 15:
+    print_both("arithmetic equations must contain operands, parenthesis, numbers, or symbols\n");
+    break;
+  case 16:
+    print_both("program too long\n");
+    break;
+  case 17:
+    print_both("call must be followed by an identifier\n");
+    break;
+  case 18:
+    print_both("cannot call variable or constant\n");
+    break;
+  case 19:
+    print_both("constant expressions may only use numbers and constants\n");
+    break;
+  case 20:
+    print_both("constant expression overflows\n");
+    break;
+  case 21:
+    print_both("constant expression divides by zero\n");
+    break;
+  }
+
+  fail();
+}
+
+// Don't leave a partially streamed code file or map behind
+void remove_partial_output()
+{
+  if (elf_file != NULL && !server_mode)
+  {
+    fclose(elf_file);
+    remove("elf.txt");
+  }
+  if (map_file != NULL && !server_mode)
+  {
+    fclose(map_file);
+    remove("elf.map");
+  }
+}
+
+// Find a symbol in the symbol table
+int check_symbol_table(char *string, int to_add)
+{
+  for (int i = tx - 1; i >= 0; i--)
+  {
+    if (to_add && strcmp(string, symbol_table[i].name) == 0 && level == symbol_table[i].level)
+    {
+      return i;
+    }
+    else if (!to_add && strcmp(string, symbol_table[i].name) == 0 && symbol_table[i].level <= level)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Add a symbol to the symbol table
+void add_symbol(int kind, char *name, int val, int level, int addr, int mark)
+{
+  reserve_symbols(tx + 1);
+  symbol_table[tx].kind = kind;
+  strcpy(symbol_table[tx].name, name);
+  symbol_table[tx].val = val;
+  symbol_table[tx].level = level;
+  symbol_table[tx].addr = addr;
+  symbol_table[tx].mark = mark;
+  tx++;
+}
+
+// Make room for count symbols in this thread's symbol table
+void reserve_symbols(int count)
+{
+  if (count <= symbol_capacity)
+    return;
+  while (symbol_capacity < count)
+    symbol_capacity = symbol_capacity == 0 ? 64 : symbol_capacity * 2;
+  symbol_table = realloc(symbol_table, sizeof(symbol) * symbol_capacity);
+}
+
+// Record a procedure named name nested in procedure parent and return its id. The streaming
+// compiler has written out every procedure before the current one and runs no pass over the whole
+// program, so it keeps nothing per procedure and writes the name straight to the map file.
+int new_procedure(char *name, int parent)
+{
+  if (streaming && parallel_threads == 0)
+  {
+    if (debug_info)
+      fprintf(map_file, "proc %d %s\n", num_procs, name);
+    return num_procs++;
+  }
+
+  if (num_procs == proc_capacity)
+    grow_procedure_tables();
+  if (parallel_threads > 0)
+  {
+    if (num_procs == job_capacity)
+    {
+      job_capacity = job_capacity == 0 ? 64 : job_capacity * 2;
+      jobs = realloc(jobs, sizeof(body_job) * job_capacity);
+    }
+    memset(&jobs[num_procs], 0, sizeof(body_job));
+  }
+  proc_parent[num_procs] = parent;
+  strcpy(proc_names[num_procs], name);
+  return num_procs++;
+}
+
+// Double the tables indexed by procedure id
+void grow_procedure_tables()
+{
+  proc_capacity = proc_capacity == 0 ? 64 : proc_capacity * 2;
+  proc_names = realloc(proc_names, sizeof(*proc_names) * proc_capacity);
+  frame_before = realloc(frame_before, sizeof(int) * proc_capacity);
+  frame_after = realloc(frame_after, sizeof(int) * proc_capacity);
+  folded_into = realloc(folded_into, sizeof(int) * proc_capacity);
+  folded_length = realloc(folded_length, sizeof(int) * proc_capacity);
+  proc_frame = realloc(proc_frame, sizeof(int) * proc_capacity);
+  proc_peak = realloc(proc_peak, sizeof(int) * proc_capacity);
+  proc_total = realloc(proc_total, sizeof(int) * proc_capacity);
+  proc_cost = realloc(proc_cost, sizeof(int) * proc_capacity);
+  proc_state = realloc(proc_state, sizeof(int) * proc_capacity);
+  proc_parent = realloc(proc_parent, sizeof(int) * proc_capacity);
+}
+
+// Double the tables indexed by level
+void grow_level_tables()
+{
+  level_capacity = level_capacity == 0 ? 16 : level_capacity * 2;
+  block_jmp = realloc(block_jmp, sizeof(int) * level_capacity);
+  pending_offset = realloc(pending_offset, sizeof(long) * level_capacity);
+}
+
+// Parse the program
+void program()
+{
+  if (parallel_threads == 0 || !generate_in_parallel())
+  {
+    reset_parser(); // Start over if a parallel attempt gave up
+    new_procedure("main", -1);
+    get_next_token();
+    block();                                    // Parse block
+    if (atoi(current_token.value) != periodsym) // Check if program ends with a period
+    {
+      error(1); // Error if it doesn't
+    }
+    if (pipeline_running)
+      finish_pipeline(); // Lex the rest of the input unless streaming, as the serial compiler would have
+  }
+  emit(9, 0, 3); // Emit halt instruction
+
+  if (object_output)
+    emit_external_stubs(); // Give external calls a target the optimizer can reason about
+
+  int whole_program = optimize_level > 1 && !streaming && cx <= MAX_OPTIMIZED_LENGTH; // Run the -O2 passes
+
+  if (whole_program)
+    propagate_constants(); // Replace loads of known values and remove branches that are never taken
+
+  if (whole_program)
+    eliminate_common_subexpressions(); // Reuse values computed earlier in the same block
+
+  if (whole_program)
+    compact_frames(); // Let variables that are never live at the same time share a frame slot
+
+  if (whole_program)
+    fold_identical_procedures(); // Give procedures with the same code one body
+
+  if (extended_isa && !streaming)
+    fuse_superinstructions(); // Replace common patterns with extended instructions
+
+  print_both("Source Program:\n");
+  print_source_code();
+  print_both("\n");
+  print_both("No errors, program is syntactically correct.\n");
+  print_both("\n");
+  print_both("Generated Code:\n");
+  if (streaming)
+  {
+    flush_code();
+    print_streamed_code();
+    if (debug_info)
+      finish_code_map();
+  }
+  else
+    print_elf_file();
+
+  if (whole_program)
+  {
+    print_frame_report();
+    print_folding_report();
+  }
+
+  if (analyze && !streaming)
+    print_analysis_report();
+}
+
+void block()
+{
+  level++;      // Increment level
+  if (level == level_capacity)
+    grow_level_tables();
+  prev_tx = tx; // Save previous symbol table index
+  dx = 4;       // Reserve space for return value, static link, dynamic link, and return address
+  int jx = cx;  // Save current code index to jump to
+
+  if (declaring)
+    jobs[current_proc].jmp_line = last_line ? last_line : current_token.line;
+  else
+  {
+    block_jmp[level] = code_base + jx; // Remember JMP in case it is flushed before being patched
+    emit(7, 0, 0);                     // Emit JMP instruction
+  }
+
+  if (atoi(current_token.value) == constsym)
+    const_declaration(); // Parse constants
+
+  if (atoi(current_token.value) == varsym)
+    dx += var_declaration(); // Parse variables
+
+  int frame_size = dx; // Nested procedures reset dx for their own frames
+  while (atoi(current_token.value) == procsym)
+    procedure(); // Parse procedures
+  dx = frame_size;
+
+  if (declaring)
+    declare_body(); // Leave the statement to a code generation thread
+  else
+  {
+    patch_block_jump(block_jmp[level], code_address(cx)); // Set JMP instruction's M to current code index
+    block_body();
+  }
+
+  tx = prev_tx; // Reset symbol table index
+  level--;      // Decrement level
+}
+
+// Generate the INC, statement and RTN that follow a block's declarations
+void block_body()
+{
+  int inc_x = cx; // Save INC index so compiler temporaries can grow the frame
+  emit(6, 0, dx);      // Emit INC instruction
+
+  statement();        // Parse statement
+  code[inc_x].m = dx; // Set INC instruction's M to final frame size
+
+  if (level > 0)
+  {
+    // A call right before RTN can reuse this frame, unless the callee's static link is this frame
+    if (optimize_level > 0 && extended_isa && code[cx - 1].op == 5 && code[cx - 1].l > 0)
+      code[cx - 1].op = 21; // Turn CAL into TCL
+    emit(2, 0, 0); // Emit RTN instruction
+    if (streaming && !speculating)
+      flush_code(); // Procedure is finished, write it out
+  }
+}
+
+void procedure()
+{
+  while (atoi(current_token.value) == procsym)
+  {
+    get_next_token();
+    if (atoi(current_token.value) != identsym) // Check if next token is an identifier
+    {
+      error(2); // Error if it isn't
+    }
+
+    // Add procedure to symbol table. Until the bodies are linked, -j refers to procedures by id.
+    add_symbol(3, current_token.lexeme, 0, level, declaring ? num_procs : code_address(cx), 0);
+    int parent_proc = current_proc;
+    current_proc = new_procedure(current_token.lexeme, parent_proc); // Code emitted from here to the end of the block belongs to this procedure
+    get_next_token();
+    if (atoi(current_token.value) != semicolonsym) // Check if next token is a semicolon
+    {
+      error(6); // Error if it isn't
+    }
+
+    get_next_token();
+
+    block();                    // Parse block
+    current_proc = parent_proc; // Back to the enclosing procedure's code
+    if (atoi(current_token.value) != semicolonsym) // Check if next token is a semicolon
+    {
+      error(6); // Error if it isn't
+    }
+    get_next_token();
+  }
+}
+
+// Parse constants
+void const_declaration()
+{
+  char name[MAX_IDENTIFIER_LENGTH + 1]; // Track name of constant
+                                        // Check if current token is a const
+  do
+  {
+    get_next_token();
+    if (atoi(current_token.value) != identsym) // Check if next token is an identifier
+    {
+      error(2); // Error if it isn't
+    }
+    strcpy(name, current_token.lexeme);                    // Save name of constant
+    if (check_symbol_table(current_token.lexeme, 1) != -1) // Check if constant has already been declared
+    {
+      error(3); // Error if it has
+    }
+    get_next_token();
+    if (atoi(current_token.value) != eqsym) // Check if next token is an equals sign
+    {
+      error(4); // Error if it isn't
+    }
+    get_next_token();
+    add_symbol(1, name, constant_expression(), level, 0, 0); // Add constant to symbol table
+  } while (atoi(current_token.value) == commasym); // Continue parsing constants if next token is a comma
+  if (atoi(current_token.value) != semicolonsym)   // Check if next token is a semicolon
+  {
+    error(6); // Error if it isn't
+  }
+  get_next_token();
+}
+
+// Parse variables
+int var_declaration()
+{
+  int num_vars = 0; // Track number of variables
+  do
+  {
+    num_vars++; // Increment number of variables
+    get_next_token();
+    if (atoi(current_token.value) != identsym) // Check if next token is an identifier
+    {
+      error(2);
+    }
+    if (check_symbol_table(current_token.lexeme, 1) != -1) // Check if variable has already been declared
+    {
+      error(3); // Error if it has
+    }
+    add_symbol(2, current_token.lexeme, 0, level, num_vars + 2, 0); // Add variable to symbol table
+
+    get_next_token();
+  } while (atoi(current_token.value) == commasym); // Continue parsing variables if next token is a comma
+  if (atoi(current_token.value) != semicolonsym)   // Check if next token is a semicolon
+  {
+    error(6); // Error if it isn't
+  }
   get_next_token();
-  block();                                    // Parse block
-  if (atoi(current_token.value) != periodsym) // Check if program ends with a period
+
+  return num_vars; // Return number of variables
+}
+
+// Parse statements. Compound statements are kept on an explicit stack instead of the C stack, so
+// begin, if and while can nest as deeply as memory allows.
+void statement()
+{
+  int base = num_open; // Compound statements opened by callers
+  do
+  {
+    if (statement_head())
+      continue; // Parse the first statement inside the one just opened
+    while (num_open > base && close_statement())
+      ; // Finish each compound statement the statement just parsed ends
+  } while (num_open > base);
+}
+
+// Parse a statement up to the statement nested in it. Simple statements are parsed completely and
+// return 0. A begin, if or while is pushed on the open statement stack, returning 1.
+int statement_head()
+{
+  if (atoi(current_token.value) == identsym) // Check if current token is an identifier
+  {
+    int sx = check_symbol_table(current_token.lexeme, 0); // Check if identifier is in symbol table
+    if (sx == -1)
+    {
+      error(7); // Error if it isn't
+    }
+    if (symbol_table[sx].kind != 2) // Check if identifier is a variable
+    {
+      error(8); // Error if it isn't
+    }
+    get_next_token();
+    if (atoi(current_token.value) != becomessym) // Check if next token is a becomes symbol (:=)
+    {
+      error(9); // Error if it isn't
+    }
+    get_next_token();
+    expression();                                                   // Parse expression
+    emit(4, level - symbol_table[sx].level, symbol_table[sx].addr); // Emit STO instruction
+  }
+  else if (atoi(current_token.value) == callsym)
+  {
+    get_next_token();
+    if (atoi(current_token.value) != identsym) // Check if next token is an identifier
+    {
+      error(17); // Error if it isn't
+    }
+    int i = check_symbol_table(current_token.lexeme, 0); // Check if identifier is in symbol table
+    if (i == -1 && object_output && !speculating)
+    {
+      // Another module's top-level procedure, whose static link is the main frame
+      emit(5, level, external_address(current_token.lexeme)); // Emit CAL instruction
+    }
+    else
+    {
+      if (i == -1)
+      {
+        error(7); // Error if it isn't
+      }
+      if (symbol_table[i].kind != 3) // Check if identifier is a procedure
+      {
+        error(18); // Error if it isn't
+      }
+      emit(5, level - symbol_table[i].level, symbol_table[i].addr); // Emit CAL instruction
+    }
+    get_next_token();
+  }
+  else if (atoi(current_token.value) == beginsym) // Check if current token is a begin
+  {
+    get_next_token();
+    open_statement(beginsym, 0, 0, 0); // Statements follow until end
+    return 1;
+  }
+  else if (atoi(current_token.value) == ifsym) // Check if current token is an if
+  {
+    get_next_token();
+    condition(); // Parse condition
+    int jx = cx;
+    emit(8, 0, 0);                            // Emit JPC instruction
+    if (atoi(current_token.value) != thensym) // Check if next token is a then
+    {
+      error(11); // Error if it isn't
+    }
+    get_next_token();
+    open_statement(ifsym, jx, 0, 0); // JPC is patched once the statement is parsed
+    return 1;
+  }
+  else if (atoi(current_token.value) == whilesym) // Check if current token is a while
+  {
+    get_next_token();
+    int lx = cx;
+    condition();                            // Parse condition
+    if (atoi(current_token.value) != dosym) // Check if next token is a do
+    {
+      error(12); // Error if it isn't
+    }
+    int cond_end = cx; // Save end of condition code for loop rotation
+    get_next_token();
+    int jx = cx;   // Save current code index to jump to
+    emit(8, 0, 0); // Emit JPC instruction
+    open_statement(whilesym, jx, lx, cond_end); // Loop is closed once the statement is parsed
+    return 1;
+  }
+  else if (atoi(current_token.value) == readsym) // Check if current token is a read
+  {
+    get_next_token();
+    if (atoi(current_token.value) != identsym) // Check if current token is an identifier
+    {
+      error(2); // Error if it isn't
+    }
+    int sx = check_symbol_table(current_token.lexeme, 0); // Check if identifier is in symbol table
+    if (sx == -1)
+    {
+      error(7); // Error if it isn't
+    }
+    if (symbol_table[sx].kind != 2) // Check if identifier is a variable
+    {
+      error(8); // Error if it isn't
+    }
+    get_next_token();
+    emit(9, 0, 2);      // Emit SIO instruction
+    emit(4, level - symbol_table[sx].level, symbol_table[sx].addr); // Emit STO instruction
+  }
+  else if (atoi(current_token.value) == writesym) // Check if current token is a write
+  {
+    get_next_token();
+    expression();  // Parse expression
+    emit(9, 0, 1); // Emit SIO instruction
+  }
+  return 0;
+}
+
+// Push a compound statement whose nested statement is about to be parsed
+void open_statement(int kind, int jx, int lx, int cond_end)
+{
+  if (num_open == open_capacity)
+  {
+    open_capacity = open_capacity == 0 ? 64 : open_capacity * 2;
+    open_statements = realloc(open_statements, sizeof(open_compound) * open_capacity);
+  }
+  open_statements[num_open].kind = kind;
+  open_statements[num_open].jx = jx;
+  open_statements[num_open].lx = lx;
+  open_statements[num_open++].cond_end = cond_end;
+}
+
+// The innermost open statement's nested statement has been parsed. Return 0 if it is a begin that
+// goes on with another statement after a semicolon, or finish it, pop it, and return 1.
+int close_statement()
+{
+  open_compound s = open_statements[num_open - 1];
+  if (s.kind == beginsym)
+  {
+    if (atoi(current_token.value) == semicolonsym) // Continue parsing statements if next token is a semicolon
+    {
+      get_next_token();
+      return 0;
+    }
+    if (atoi(current_token.value) != endsym) // Check if next token is an end
+    {
+      error(10); // Error if it isn't
+    }
+    get_next_token();
+  }
+  else if (s.kind == ifsym)
+    code[s.jx].m = code_address(cx); // Set JPC instruction's M to current code index
+  else if (optimize_level > 0)
+  {
+    rotate_loop(s.lx, s.cond_end);         // Test the negated condition at the bottom
+    code[s.jx].m = code_address(cx);       // Set guard JPC instruction's M to current code index
+    hoist_loop_invariants(s.jx + 1, cx);   // Move invariant expressions before the loop
+  }
+  else
+  {
+    emit(7, 0, code_address(s.lx));  // Emit JMP instruction
+    code[s.jx].m = code_address(cx); // Set JPC instruction's M to current code index
+  }
+  num_open--;
+  return 1;
+}
+
+// Parse condition
+void condition()
+{
+  if (atoi(current_token.value) == oddsym) // Check if current token is odd
+  {
+    get_next_token();
+    expression();   // Parse expression
+    if (optimize_level > 0 && extended_isa)
+      emit(20, 0, 0); // Emit BIT instruction testing the low bit
+    else
+      emit(2, 0, 11); // Emit ODD instruction
+  }
+  else
+  {
+    expression();                      // Parse expression
+    switch (atoi(current_token.value)) // Check if current token is a comparison operator
+    {
+    case eqsym:
+      get_next_token();
+      expression();
+      emit(2, 0, 5); // Emit EQL instruction
+      break;
+    case neqsym:
+      get_next_token();
+      expression();
+      emit(2, 0, 6); // Emit NEQ instruction
+      break;
+    case lessym:
+      get_next_token();
+      expression();
+      emit(2, 0, 7); // Emit LSS instruction
+      break;
+    case leqsym:
+      get_next_token();
+      expression();
+      emit(2, 0, 8); // Emit LEQ instruction
+      break;
+    case gtrsym:
+      get_next_token();
+      expression();
+      emit(2, 0, 9); // Emit GTR instruction
+      break;
+    case geqsym:
+      get_next_token();
+      expression();
+      emit(2, 0, 10); // Emit GEQ instruction
+      break;
+    default:
+      error(13); // Error if it isn't
+      break;
+    }
+  }
+}
+
+// Parse expression by precedence climbing. Operators waiting for their right operand and open
+// parentheses are kept on an explicit stack, and an operator is emitted as soon as the next token
+// shows that its right operand is complete, so the code matches the grammar
+//   expression = term {("+" | "-") term}, term = factor {("*" | "/") factor},
+//   factor = ident | number | "(" expression ")"
+// with no recursion for nested parentheses.
+void expression()
+{
+  int base = num_pending; // Operators pending in callers
+  int start;              // Start of the code of the operand just parsed
+
+  for (;;)
+  {
+    while (atoi(current_token.value) == lparentsym) // Open parentheses before the operand
+    {
+      get_next_token();
+      push_pending(0, cx, 0);
+    }
+
+    start = cx;
+    if (atoi(current_token.value) == identsym) // Check if current token is an identifier
+    {
+      int sx = check_symbol_table(current_token.lexeme, 0); // Check if identifier is in symbol table
+      if (sx == -1)
+      {
+        error(7); // Error if it isn't
+      }
+      if (symbol_table[sx].kind == 1) // Check if identifier is a constant
+      {
+        emit(1, 0, symbol_table[sx].val); // Emit LIT instruction
+      }
+      else
+      {
+        emit(3, level - symbol_table[sx].level, symbol_table[sx].addr); // Emit LOD instruction
+      }
+      get_next_token();
+    }
+    else if (atoi(current_token.value) == numbersym) // Check if current token is a number
+    {
+      emit(1, 0, atoi(current_token.lexeme)); // Emit LIT instruction
+      get_next_token();
+    }
+    else
+    {
+      error(15); // Error if current token is none of the above
+    }
+
+    for (;;)
+    {
+      int sym = atoi(current_token.value);
+      int m = sym == plussym ? 1 : sym == minussym ? 2 : sym == multsym ? 3 : sym == slashsym ? 4 : 0;
+
+      // Emit the pending operators that bind at least as tightly as the next one
+      while (num_pending > base && pending[num_pending - 1].m != 0 &&
+             operator_precedence(pending[num_pending - 1].m) >= operator_precedence(m))
+      {
+        pending_operator p = pending[--num_pending];
+        emit_arithmetic(p.m, p.left_start, p.right_start);
+        start = p.left_start;
+      }
+
+      if (m != 0)
+      {
+        get_next_token();
+        push_pending(m, start, cx);
+        break; // Parse the right operand
+      }
+      if (num_pending == base)
+        return;
+
+      // The operand closes the innermost open parenthesis
+      if (sym != rparentsym) // Check if currenet token is right parenthesis
+      {
+        error(14); // Error if it isn't
+      }
+      get_next_token();
+      start = pending[--num_pending].left_start;
+    }
+  }
+}
+
+// Parse a constant's initializer and return its value. It has the grammar of expression(), over
+// numbers and constants declared earlier, and is evaluated as it is parsed. Operators wait for
+// their right operand on the same stack, holding the value of their left operand.
+int constant_expression()
+{
+  int base = num_pending; // Operators pending in callers
+  int value;              // Value of the operand just parsed
+
+  for (;;)
+  {
+    while (atoi(current_token.value) == lparentsym) // Open parentheses before the operand
+    {
+      get_next_token();
+      push_pending(0, 0, 0);
+    }
+
+    if (atoi(current_token.value) == identsym) // Check if current token is an identifier
+    {
+      int sx = check_symbol_table(current_token.lexeme, 0); // Check if identifier is in symbol table
+      if (sx == -1)
+      {
+        error(7); // Error if it isn't
+      }
+      if (symbol_table[sx].kind != 1) // Check if identifier is a constant
+      {
+        error(19); // Error if it isn't
+      }
+      value = symbol_table[sx].val;
+    }
+    else if (atoi(current_token.value) == numbersym) // Check if current token is a number
+    {
+      value = atoi(current_token.lexeme);
+    }
+    else
+    {
+      error(5); // Error if current token is none of the above
+    }
+    get_next_token();
+
+    for (;;)
+    {
+      int sym = atoi(current_token.value);
+      int m = sym == plussym ? 1 : sym == minussym ? 2 : sym == multsym ? 3 : sym == slashsym ? 4 : 0;
+
+      // Apply the pending operators that bind at least as tightly as the next one
+      while (num_pending > base && pending[num_pending - 1].m != 0 &&
+             operator_precedence(pending[num_pending - 1].m) >= operator_precedence(m))
+      {
+        pending_operator p = pending[--num_pending];
+        instruction ir = {0};
+        ir.op = 2;
+        ir.m = p.m;
+        if (p.m == 4 && value == 0)
+        {
+          error(21); // Error if dividing by zero
+        }
+        if (!fold_operation(ir, p.left_value, value, &value))
+        {
+          error(20); // Error if the result does not fit in an int
+        }
+      }
+
+      if (m != 0)
+      {
+        get_next_token();
+        push_pending(m, 0, 0);
+        pending[num_pending - 1].left_value = value;
+        break; // Parse the right operand
+      }
+      if (num_pending == base)
+        return value;
+
+      // The operand closes the innermost open parenthesis
+      if (sym != rparentsym) // Check if current token is right parenthesis
+      {
+        error(14); // Error if it isn't
+      }
+      get_next_token();
+      num_pending--;
+    }
+  }
+}
+
+// Return how tightly OPR m binds: 2 for MUL and DIV, 1 for ADD and SUB, 0 for anything else
+int operator_precedence(int m)
+{
+  return m == 3 || m == 4 ? 2 : m == 1 || m == 2;
+}
+
+// Push an operator (m of its OPR) waiting for its right operand, or an open parenthesis (m = 0)
+void push_pending(int m, int left_start, int right_start)
+{
+  if (num_pending == pending_capacity)
+  {
+    pending_capacity = pending_capacity == 0 ? 64 : pending_capacity * 2;
+    pending = realloc(pending, sizeof(pending_operator) * pending_capacity);
+  }
+  pending[num_pending].m = m;
+  pending[num_pending].left_start = left_start;
+  pending[num_pending++].right_start = right_start;
+}
+
+// Print symbol table
+void print_symbol_table()
+{
+  print_both("\nSymbol Table:\n");
+  print_both("%10s | %10s | %10s | %10s | %10s | %10s\n", "Kind", "Name", "Value", "Level", "Address", "Mark", "\n");
+  print_both("    -----------------------------------------------------------------------\n");
+
+  for (int i = 0; i < tx; i++)
+  {
+    if (symbol_table[i].kind == 0)
+      continue;
+
+    symbol_table[i].mark = 1;
+    if (symbol_table[i].kind == 1)
+      print_both("%10d | %10s | %10d | %10s | %10s | %10d\n", symbol_table[i].kind, symbol_table[i].name, symbol_table[i].val, "-", "-", symbol_table[i].mark);
+    else
+      print_both("%10d | %10s | %10d | %10d | %10d | %10d\n", symbol_table[i].kind, symbol_table[i].name, symbol_table[i].val, symbol_table[i].level, symbol_table[i].addr, symbol_table[i].mark);
+  }
+}
+
+// Print assmebly code
+void print_instructions()
+{
+
+  print_both("Assembly Code:\n");
+  print_both("%10s %10s %10s %10s\n", "Line", "OP", "L", "M");
+  for (int i = 0; i < cx; i++)
+  {
+    char name[4];
+    get_op_name(code[i].op, name);
+    print_both("%10d %10s %10d %10d\n", i, name, code[i].l, code[i].m);
+  }
+}
+
+// Get op name from op code
+void get_op_name(int op, char *name)
+{
+  switch (op)
+  {
+  case 1:
+    strcpy(name, "LIT");
+    break;
+  case 2:
+    strcpy(name, "OPR");
+    break;
+  case 3:
+    strcpy(name, "LOD");
+    break;
+  case 4:
+    strcpy(name, "STO");
+    break;
+  case 5:
+    strcpy(name, "CAL");
+    break;
+  case 6:
+    strcpy(name, "INC");
+    break;
+  case 7:
+    strcpy(name, "JMP");
+    break;
+  case 8:
+    strcpy(name, "JPC");
+    break;
+  case 9:
+    strcpy(name, "SYS");
+    break;
+  case 10:
+    strcpy(name, "LAS");
+    break;
+  case 11:
+    strcpy(name, "INV");
+    break;
+  case 12:
+    strcpy(name, "CEQ");
+    break;
+  case 13:
+    strcpy(name, "CNE");
+    break;
+  case 14:
+    strcpy(name, "CLT");
+    break;
+  case 15:
+    strcpy(name, "CLE");
+    break;
+  case 16:
+    strcpy(name, "CGT");
+    break;
+  case 17:
+    strcpy(name, "CGE");
+    break;
+  case 18:
+    strcpy(name, "SHL");
+    break;
+  case 19:
+    strcpy(name, "SHR");
+    break;
+  case 20:
+    strcpy(name, "BIT");
+    break;
+  case 21:
+    strcpy(name, "TCL");
+    break;
+  }
+}
+
+void print_elf_file()
+{
+  FILE *elf_file = server_mode ? request_code : fopen(object_output ? "elf.o" : "elf.txt", "w");
+  if (object_output)
+    write_object(elf_file);
+  else
+    for (int i = 0; i < cx; i++)
+    {
+      fprintf(elf_file, "%d %d %d\n", code[i].op, code[i].l, code[i].m);
+    }
+
+  if (!server_mode)
+    fclose(elf_file);
+
+  for (int i = 0; i < cx; i++)
+  {
+    print_both("%d %d %d\n", code[i].op, code[i].l, code[i].m);
+  }
+
+  if (debug_info)
+  {
+    write_code_map(0, cx);
+    finish_code_map();
+  }
+}
+
+// Append the source line and procedure of code[start..end) to the map file
+void write_code_map(int start, int end)
+{
+  for (int i = start; i < end; i++)
+    fprintf(map_file, "%d %d\n", code[i].line, code[i].proc);
+}
+
+// Append the procedure names to the map file, unless new_procedure() wrote them, and close it
+void finish_code_map()
+{
+  for (int i = 0; i < num_procs && !(streaming && parallel_threads == 0); i++)
+    fprintf(map_file, "proc %d %s\n", i, proc_names[i]);
+  if (!server_mode)
+    fclose(map_file);
+  map_file = NULL;
+}
+
+// Return the M address of the instruction at code index index
+int code_address(int index)
+{
+  return (code_base + index) * 3;
+}
+
+// Set the M field of the JMP at address index jx, rewriting it in place if it was already flushed
+void patch_block_jump(int jx, int m)
+{
+  if (jx >= code_base)
+  {
+    code[jx - code_base].m = m;
+    return;
+  }
+
+  long end = ftell(elf_file);
+  fseek(elf_file, pending_offset[level], SEEK_SET);
+  fprintf(elf_file, "%d %d %-10d", 7, 0, m); // Same width as the placeholder written by flush_code()
+  fseek(elf_file, end, SEEK_SET);
+}
+
+// Write the code array to the code file and start a new, empty code array
+void flush_code()
+{
+  for (int i = 0; i < cx; i++)
+  {
+    int pending = -1; // Level whose unpatched JMP this is, if any
+    for (int l = 0; l < level; l++)
+      if (block_jmp[l] == code_base + i)
+        pending = l;
+
+    if (pending != -1)
+    {
+      pending_offset[pending] = ftell(elf_file);
+      fprintf(elf_file, "%d %d %-10d\n", code[i].op, code[i].l, code[i].m);
+    }
+    else
+      fprintf(elf_file, "%d %d %d\n", code[i].op, code[i].l, code[i].m);
+  }
+  if (debug_info)
+    write_code_map(0, cx);
+
+  code_base += cx;
+  cx = 0;
+}
+
+// Print the code file written in streaming mode
+void print_streamed_code()
+{
+  instruction i;
+  rewind(elf_file);
+  while (fscanf(elf_file, "%d %d %d", &i.op, &i.l, &i.m) == 3)
+    print_both("%d %d %d\n", i.op, i.l, i.m);
+
+  if (!server_mode) // The server sends the worker's code file back
+    fclose(elf_file);
+  elf_file = NULL;
+}
+
+// Check if an instruction is the OPR ADD instruction
+int is_add(instruction i)
+{
+  return i.op == 2 && i.m == 1;
+}
+
+// Check if an instruction pushes a single operand (LIT or LOD)
+int is_operand(instruction i)
+{
+  return i.op == 1 || i.op == 3;
+}
+
+// Check if two instructions address the same variable
+int same_variable(instruction a, instruction b)
+{
+  return a.l == b.l && a.m == b.m;
+}
+
+// Check if an instruction transfers control to its M address
+int is_jump(instruction i)
+{
+  return i.op == 5 || i.op == 7 || i.op == 8 || (i.op >= 12 && i.op <= 17) || i.op == 21;
+}
+
+// Fuse common instruction patterns into extended superinstructions
+//   LOD a; LIT 1; ADD; STO a       -> INV a
+//   LOD a; LOD b|LIT n; ADD; STO a -> LOD b|LIT n; LAS a (either operand order)
+//   LIT n; OPR rel; JPC t          -> Crel n t (L holds the literal)
+// Patterns never span a jump target, and every jump is relocated afterwards
+void fuse_superinstructions()
+{
+  int *is_target = calloc(cx + 1, sizeof(int));
+  int *new_index = malloc(sizeof(int) * (cx + 1));
+  instruction *fused = malloc(sizeof(instruction) * cx);
+  int nx = 0; // Fused code index
+
+  for (int i = 0; i < cx; i++)
+    if (is_jump(code[i]))
+      is_target[code[i].m / 3] = 1;
+
+  int i = 0;
+  while (i < cx)
+  {
+    new_index[i] = nx;
+
+    if (i + 3 < cx && !is_target[i + 1] && !is_target[i + 2] && !is_target[i + 3] &&
+        is_add(code[i + 2]) && code[i + 3].op == 4)
+    {
+      instruction a = code[i], b = code[i + 1], sto = code[i + 3];
+      int a_is_var = a.op == 3 && same_variable(a, sto);
+      int b_is_var = b.op == 3 && same_variable(b, sto);
+
+      if ((a_is_var && b.op == 1 && b.m == 1) || (b_is_var && a.op == 1 && a.m == 1))
+      {
+        fused[nx] = sto;
+        fused[nx].op = 11; // INV
+        new_index[i + 1] = new_index[i + 2] = new_index[i + 3] = nx++;
+        i += 4;
+        continue;
+      }
+
+      if ((a_is_var && is_operand(b)) || (b_is_var && is_operand(a)))
+      {
+        fused[nx++] = a_is_var ? b : a; // Push the other operand
+        fused[nx] = sto;
+        fused[nx].op = 10; // LAS
+        new_index[i + 1] = new_index[i + 2] = new_index[i + 3] = nx++;
+        i += 4;
+        continue;
+      }
+    }
+
+    if (i + 2 < cx && !is_target[i + 1] && !is_target[i + 2] &&
+        code[i].op == 1 && code[i + 1].op == 2 && code[i + 1].m >= 5 && code[i + 1].m <= 10 &&
+        code[i + 2].op == 8)
+    {
+      fused[nx] = code[i + 2];
+      fused[nx].op = 12 + code[i + 1].m - 5; // CEQ..CGE follow EQL..GEQ order
+      fused[nx].l = code[i].m;
+      new_index[i + 1] = new_index[i + 2] = nx++;
+      i += 3;
+      continue;
+    }
+
+    fused[nx++] = code[i++];
+  }
+  new_index[cx] = nx;
+
+  // Relocate jump and call addresses to the fused layout
+  for (int j = 0; j < nx; j++)
+    if (is_jump(fused[j]))
+      fused[j].m = new_index[fused[j].m / 3] * 3;
+
+  for (int j = 0; j < nx; j++)
+    code[j] = fused[j];
+  cx = nx;
+  free(is_target);
+  free(new_index);
+  free(fused);
+}
+
+// Check if an instruction is an OPR that is safe to evaluate speculatively
+int is_pure_arithmetic(instruction i)
+{
+  return i.op == 2 && (i.m == 1 || i.m == 2 || i.m == 3); // ADD, SUB, MUL (DIV may trap)
+}
+
+// Check if an instruction rewrites the top of the stack in place (SHL, SHR, BIT)
+int is_unary_arithmetic(instruction i)
+{
+  return i.op >= 18 && i.op <= 20;
+}
+
+// Emit a copy of the loop condition with its result negated, followed by a
+// JPC back to the top of the body, so each iteration executes one branch
+void rotate_loop(int lx, int cond_end)
+{
+  int top = cond_end + 1; // First body instruction follows the guard JPC
+  for (int i = lx; i < cond_end - 1; i++)
+    emit(code[i].op, code[i].l, code[i].m);
+
+  instruction rel = code[cond_end - 1];
+  switch (rel.op == 2 ? rel.m : 0)
+  {
+  case 5: // EQL <-> NEQ
+    emit(2, 0, 6);
+    break;
+  case 6:
+    emit(2, 0, 5);
+    break;
+  case 7: // LSS <-> GEQ
+    emit(2, 0, 10);
+    break;
+  case 10:
+    emit(2, 0, 7);
+    break;
+  case 8: // LEQ <-> GTR
+    emit(2, 0, 9);
+    break;
+  case 9:
+    emit(2, 0, 8);
+    break;
+  default: // ODD and BIT have no inverse, so compare their result with zero
+    emit(rel.op, rel.l, rel.m);
+    emit(1, 0, 0);
+    emit(2, 0, 5);
+    break;
+  }
+  emit(8, 0, code_address(top)); // Emit JPC back to the body
+}
+
+// Hoist expressions whose operands the loop [top, end) never stores into
+// compiler temporaries computed once before the loop
+void hoist_loop_invariants(int top, int end)
+{
+  for (int i = top; i < end; i++)
+    if (code[i].op == 5) // A callee may store any variable it can reach
+      return;
+
+  int *stored_l = malloc(sizeof(int) * (end - top)), *stored_m = malloc(sizeof(int) * (end - top));
+  int num_stored = 0;
+  for (int i = top; i < end; i++)
+  {
+    if (code[i].op == 4)
+    {
+      stored_l[num_stored] = code[i].l;
+      stored_m[num_stored++] = code[i].m;
+    }
+  }
+
+  int *hoist_end = malloc(sizeof(int) * (end - top)); // Last instruction of the invariant expression starting at i, or -1
+  int num_hoisted = 0;
+  for (int i = top; i < end; i++)
+  {
+    hoist_end[i - top] = -1;
+    int depth = 0;
+    for (int j = i; j < end; j++)
+    {
+      int invariant = code[j].op == 1 || is_pure_arithmetic(code[j]) || is_unary_arithmetic(code[j]);
+      if (code[j].op == 3)
+      {
+        invariant = 1;
+        for (int k = 0; k < num_stored; k++)
+          if (stored_l[k] == code[j].l && stored_m[k] == code[j].m)
+            invariant = 0;
+      }
+      if (!invariant)
+        break;
+
+      if (!is_unary_arithmetic(code[j]))
+        depth += code[j].op == 2 ? -1 : 1;
+      if (depth <= 0) // Operator consumes a value pushed before the expression
+        break;
+      if (depth == 1 && (code[j].op == 2 || is_unary_arithmetic(code[j])))
+        hoist_end[i - top] = j;
+    }
+
+    if (hoist_end[i - top] != -1)
+    {
+      num_hoisted++;
+      for (int j = i + 1; j <= hoist_end[i - top]; j++)
+        hoist_end[j - top] = -1;
+      i = hoist_end[i - top];
+    }
+  }
+
+  free(stored_l);
+  free(stored_m);
+  if (num_hoisted == 0)
+  {
+    free(hoist_end);
+    return;
+  }
+
+  instruction *loop = malloc(sizeof(instruction) * (end - top + 2 * num_hoisted)); // Each adds a STO and LOD
+  int *new_index = malloc(sizeof(int) * (end - top + 1));
+  int nx = 0;
+  int *temps = malloc(sizeof(int) * num_hoisted);
+
+  // Preheader: evaluate each invariant expression once into a fresh frame slot
+  for (int i = top, t = 0; i < end; i++)
+  {
+    if (hoist_end[i - top] == -1)
+      continue;
+    temps[t] = dx - 1;
+    dx++;
+    for (int j = i; j <= hoist_end[i - top]; j++)
+      loop[nx++] = code[j];
+    loop[nx] = code[hoist_end[i - top]];
+    loop[nx].op = 4;
+    loop[nx].l = 0;
+    loop[nx++].m = temps[t++];
+    i = hoist_end[i - top];
+  }
+
+  // Loop body with every hoisted expression replaced by a load of its temporary
+  for (int i = top, t = 0; i < end; i++)
+  {
+    new_index[i - top] = nx;
+    if (hoist_end[i - top] == -1)
+    {
+      loop[nx++] = code[i];
+      continue;
+    }
+    loop[nx] = code[i];
+    loop[nx].op = 3;
+    loop[nx].l = 0;
+    loop[nx++].m = temps[t++];
+    for (int j = i + 1; j <= hoist_end[i - top]; j++)
+      new_index[j - top] = nx - 1;
+    i = hoist_end[i - top];
+  }
+  new_index[end - top] = nx;
+
+  reserve_code(top + nx);
+  for (int i = 0; i < nx; i++)
+    code[top + i] = loop[i];
+  cx = top + nx;
+
+  // Relocate jumps into the loop, including the guard and the back edge
+  for (int i = 0; i < cx; i++)
+  {
+    int target = code[i].m / 3 - code_base;
+    if ((code[i].op == 7 || code[i].op == 8) && target >= top && target <= end)
+      code[i].m = code_address(top + new_index[target - top]);
+  }
+  free(hoist_end);
+  free(loop);
+  free(new_index);
+  free(temps);
+}
+
+// Return k if value is 2^k for k >= 1, otherwise 0
+int power_of_two(int value)
+{
+  int k = 0;
+  if (value < 2 || (value & (value - 1)) != 0)
+    return 0;
+  while (value > 1)
+  {
+    value >>= 1;
+    k++;
+  }
+  return k;
+}
+
+// Check if the code in [start, end) contains a DIV that could trap at runtime
+int contains_division(int start, int end)
+{
+  for (int i = start; i < end; i++)
+    if (code[i].op == 2 && code[i].m == 4)
+      return 1;
+  return 0;
+}
+
+// Emit the OPR instruction m combining the operands compiled at [left_start, right_start)
+// and [right_start, cx), simplifying constant operands when optimizing
+void emit_arithmetic(int m, int left_start, int right_start)
+{
+  if (optimize_level == 0)
+  {
+    emit(2, 0, m);
+    return;
+  }
+
+  int left_lit = right_start - left_start == 1 && code[left_start].op == 1;
+  int right_lit = cx - right_start == 1 && code[right_start].op == 1;
+  int lv = code[left_start].m, rv = code[right_start].m;
+
+  instruction ir = {0};
+  ir.op = 2;
+  ir.m = m;
+  int value;
+  if (left_lit && right_lit && fold_operation(ir, lv, rv, &value)) // Fold constant operands
+  {
+    cx = left_start;
+    emit(1, 0, value); // Emit LIT instruction
+    return;
+  }
+
+  if (right_lit)
+  {
+    if (((m == 1 || m == 2) && rv == 0) || ((m == 3 || m == 4) && rv == 1)) // x + 0, x - 0, x * 1, x / 1
+    {
+      cx = right_start;
+      return;
+    }
+    if (m == 3 && rv == 0 && !contains_division(left_start, right_start)) // x * 0
+    {
+      cx = left_start;
+      emit(1, 0, 0);
+      return;
+    }
+    if ((m == 3 || m == 4) && power_of_two(rv) && extended_isa) // x * 2^k, x / 2^k
+    {
+      cx = right_start;
+      emit(m == 3 ? 18 : 19, 0, power_of_two(rv)); // Emit SHL or SHR instruction
+      return;
+    }
+  }
+
+  if (left_lit && (m == 1 || m == 3)) // Commutative operators with a constant left operand
+  {
+    if (m == 3 && lv == 0 && !contains_division(right_start, cx)) // 0 * x
+    {
+      cx = left_start;
+      emit(1, 0, 0);
+      return;
+    }
+    if ((m == 1 && lv == 0) || (m == 3 && lv == 1) || (m == 3 && power_of_two(lv) && extended_isa))
+    {
+      // Drop the constant by moving the right operand down over it
+      for (int i = right_start; i < cx; i++)
+        code[i - 1] = code[i];
+      cx--;
+      if (m == 3 && power_of_two(lv))
+        emit(18, 0, power_of_two(lv)); // Emit SHL instruction
+      return;
+    }
+  }
+
+  emit(2, 0, m);
+}
+
+// Return the code index of the INC that allocates the frame of procedure proc
+int frame_inc_index(int proc)
+{
+  for (int i = 0; i < cx; i++)
+    if (code[i].op == 6 && code[i].proc == proc)
+      return i;
+  return -1;
+}
+
+// Replace repeated subexpressions in each extended basic block with a load of a variable that
+// still holds the value, or of a compiler temporary saved where the value was first computed.
+// Values are tracked by local value numbering: STO rebinds a variable, read produces a fresh
+// value, and CAL forgets the variables the callee can reach through its static link.
+void eliminate_common_subexpressions()
+{
+  int *is_target = calloc(cx + 1, sizeof(int));
+  for (int i = 0; i < cx; i++)
+    if (is_jump(code[i]))
+      is_target[code[i].m / 3] = 1;
+
+  // Each instruction adds at most one variable, expression or stack entry
+  int *var_l = malloc(sizeof(int) * cx), *var_m = malloc(sizeof(int) * cx), *var_vn = malloc(sizeof(int) * cx);
+  int *expr_op = malloc(sizeof(int) * cx), *expr_m = malloc(sizeof(int) * cx), *expr_a = malloc(sizeof(int) * cx);
+  int *expr_b = malloc(sizeof(int) * cx), *expr_vn = malloc(sizeof(int) * cx), *expr_first = malloc(sizeof(int) * cx);
+  int *stack_vn = malloc(sizeof(int) * cx), *stack_start = malloc(sizeof(int) * cx);
+  int num_vars = 0, num_exprs = 0, depth = 0, next_vn = 1;
+
+  int *span_start = malloc(sizeof(int) * cx); // Start of the expression ending at i to replace, or -1
+  int *source_first = malloc(sizeof(int) * cx); // First computation of the value, when loaded from a temporary
+  int *source_l = malloc(sizeof(int) * cx), *source_m = malloc(sizeof(int) * cx); // Variable holding the value, otherwise
+
+  for (int i = 0; i < cx; i++)
+  {
+    span_start[i] = -1;
+    if (is_target[i]) // Labels start a new block
+      num_vars = num_exprs = depth = 0;
+
+    instruction ir = code[i];
+    int vn = 0, a = 0, b = 0, start = i, key = 0;
+
+    if (ir.op == 1) // LIT
+    {
+      key = 1;
+      a = ir.m;
+    }
+    else if (ir.op == 3) // LOD
+    {
+      for (int v = 0; v < num_vars; v++)
+        if (var_l[v] == ir.l && var_m[v] == ir.m)
+          vn = var_vn[v];
+      if (vn == 0)
+      {
+        vn = next_vn++;
+        var_l[num_vars] = ir.l;
+        var_m[num_vars] = ir.m;
+        var_vn[num_vars++] = vn;
+      }
+    }
+    else if ((ir.op == 2 && ir.m != 0 && ir.m != 11) && depth >= 2) // Binary OPR
+    {
+      key = 2;
+      a = stack_vn[depth - 2];
+      b = stack_vn[depth - 1];
+      start = stack_start[depth - 2];
+      if ((ir.m == 1 || ir.m == 3 || ir.m == 5 || ir.m == 6) && a > b) // Commutative
+      {
+        a = stack_vn[depth - 1];
+        b = stack_vn[depth - 2];
+      }
+      depth -= 2;
+    }
+    else if ((ir.m == 11 && ir.op == 2) || is_unary_arithmetic(ir)) // ODD, SHL, SHR, BIT
+    {
+      if (depth < 1)
+      {
+        num_vars = num_exprs = depth = 0;
+        continue;
+      }
+      key = 2;
+      a = stack_vn[depth - 1];
+      start = stack_start[depth - 1];
+      depth--;
+    }
+    else if (ir.op == 4 && depth >= 1) // STO binds the variable to the stored value
+    {
+      int v = 0;
+      while (v < num_vars && !(var_l[v] == ir.l && var_m[v] == ir.m))
+        v++;
+      var_l[v] = ir.l;
+      var_m[v] = ir.m;
+      var_vn[v] = stack_vn[--depth];
+      if (v == num_vars)
+        num_vars++;
+      continue;
+    }
+    else if (ir.op == 5) // CAL: the callee can store into frames at static distance ir.l and beyond
+    {
+      int kept = 0;
+      for (int v = 0; v < num_vars; v++)
+        if (var_l[v] < ir.l)
+        {
+          var_l[kept] = var_l[v];
+          var_m[kept] = var_m[v];
+          var_vn[kept++] = var_vn[v];
+        }
+      num_vars = kept;
+      continue;
+    }
+    else if (ir.op == 9 && ir.m == 2) // Read produces an unknown value
+      vn = next_vn++;
+    else if (ir.op == 8 && depth >= 1) // JPC falls through into the same extended block
+    {
+      depth--;
+      continue;
+    }
+    else if (ir.op == 9 && ir.m == 1 && depth >= 1) // Write
+    {
+      depth--;
+      continue;
+    }
+    else if (ir.op == 6) // INC
+      continue;
+    else // Unconditional transfers end the block, anything unexpected resets it
+    {
+      num_vars = num_exprs = depth = 0;
+      continue;
+    }
+
+    if (key != 0) // Look the expression up, or number it
+    {
+      for (int e = 0; e < num_exprs && vn == 0; e++)
+        if (expr_op[e] == ir.op && expr_m[e] == (key == 1 ? 0 : ir.m) && expr_a[e] == a && expr_b[e] == b)
+        {
+          vn = expr_vn[e];
+          if (key == 2) // Recomputation of an earlier value
+          {
+            span_start[i] = start;
+            source_first[i] = expr_first[e];
+            source_l[i] = -1;
+            for (int v = 0; v < num_vars; v++)
+              if (var_vn[v] == vn)
+              {
+                source_l[i] = var_l[v];
+                source_m[i] = var_m[v];
+              }
+          }
+        }
+      if (vn == 0)
+      {
+        vn = next_vn++;
+        expr_op[num_exprs] = ir.op;
+        expr_m[num_exprs] = key == 1 ? 0 : ir.m;
+        expr_a[num_exprs] = a;
+        expr_b[num_exprs] = b;
+        expr_vn[num_exprs] = vn;
+        expr_first[num_exprs++] = i;
+      }
+    }
+
+    stack_vn[depth] = vn;
+    stack_start[depth++] = start;
+  }
+
+  // Keep only outermost replacements
+  for (int i = 0; i < cx; i++)
+    if (span_start[i] != -1)
+      for (int j = span_start[i]; j < i; j++)
+        span_start[j] = -1;
+
+  // A temporary costs a STO and LOD at the first computation, so it must save more than that
+  int *temp_of = malloc(sizeof(int) * cx); // Temporary address saved after instruction i, or -1
+  for (int i = 0; i < cx; i++)
+    temp_of[i] = -1;
+  for (int f = 0; f < cx; f++)
   {
-    error(1); // Error if it doesn't
+    int saved = 0;
+    for (int i = f + 1; i < cx; i++)
+      if (span_start[i] != -1 && source_l[i] == -1 && source_first[i] == f)
+        saved += i - span_start[i];
+    if (saved <= 2)
+    {
+      for (int i = f + 1; i < cx; i++)
+        if (span_start[i] != -1 && source_l[i] == -1 && source_first[i] == f)
+          span_start[i] = -1;
+      continue;
+    }
+    int inc = frame_inc_index(code[f].proc);
+    if (inc == -1)
+      continue;
+    temp_of[f] = code[inc].m - 1;
+    code[inc].m++;
   }
-  emit(9, 0, 3); // Emit halt instruction
 
-  print_both("Source Program:\n");
-  print_source_code();
-  print_both("\n");
-  print_both("No errors, program is syntactically correct.\n");
-  print_both("\n");
-  print_both("Generated Code:\n");
-  print_elf_file();
+  instruction *reduced = malloc(sizeof(instruction) * 3 * cx); // A saved value adds a STO and LOD
+  int *new_index = malloc(sizeof(int) * (cx + 1));
+  int nx = 0;
+  int *replaced_end = malloc(sizeof(int) * cx); // End of the replaced expression starting at i, or -1
+  for (int i = 0; i < cx; i++)
+    replaced_end[i] = -1;
+  for (int i = 0; i < cx; i++)
+    if (span_start[i] != -1)
+      replaced_end[span_start[i]] = i;
+
+  for (int i = 0; i < cx; i++)
+  {
+    new_index[i] = nx;
+
+    if (replaced_end[i] != -1)
+    {
+      int end = replaced_end[i];
+      reduced[nx] = code[i];
+      reduced[nx].op = 3;
+      reduced[nx].l = source_l[end] != -1 ? source_l[end] : 0;
+      reduced[nx].m = source_l[end] != -1 ? source_m[end] : temp_of[source_first[end]];
+      for (int j = i + 1; j <= end; j++)
+        new_index[j] = nx;
+      nx++;
+      i = end;
+      continue;
+    }
+
+    reduced[nx++] = code[i];
+    if (temp_of[i] != -1) // Save the first computation of a reused value
+    {
+      reduced[nx] = code[i];
+      reduced[nx].op = 4;
+      reduced[nx].l = 0;
+      reduced[nx++].m = temp_of[i];
+      reduced[nx] = code[i];
+      reduced[nx].op = 3;
+      reduced[nx].l = 0;
+      reduced[nx++].m = temp_of[i];
+    }
+  }
+  new_index[cx] = nx;
+
+  for (int j = 0; j < nx; j++)
+    if (is_jump(reduced[j]))
+      reduced[j].m = new_index[reduced[j].m / 3] * 3;
+
+  reserve_code(nx);
+  for (int j = 0; j < nx; j++)
+    code[j] = reduced[j];
+  cx = nx;
+
+  free(is_target);
+  free(var_l);
+  free(var_m);
+  free(var_vn);
+  free(expr_op);
+  free(expr_m);
+  free(expr_a);
+  free(expr_b);
+  free(expr_vn);
+  free(expr_first);
+  free(stack_vn);
+  free(stack_start);
+  free(span_start);
+  free(source_first);
+  free(source_l);
+  free(source_m);
+  free(temp_of);
+  free(reduced);
+  free(new_index);
+  free(replaced_end);
 }
 
-void block()
+// Compute the result of a value-producing OPR, SHL, SHR or BIT on constant operands (b is unused for
+// unary operations). Return 0 if the result would overflow or the operation would trap at runtime.
+int fold_operation(instruction ir, int a, int b, int *result)
 {
-  level++;      // Increment level
-  prev_tx = tx; // Save previous symbol table index
-  dx = 4;       // Reserve space for return value, static link, dynamic link, and return address
-  int jx = cx;  // Save current code index to jump to
+  long long value;
+  if (ir.op == 18 || ir.op == 19 || ir.op == 20)
+  {
+    if (ir.op == 18)
+      value = (int)((unsigned)a << ir.m);
+    else if (ir.op == 19)
+      value = (a + ((a >> 31) & ((1 << ir.m) - 1))) >> ir.m;
+    else
+      value = (a >> ir.m) & 1;
+  }
+  else if (ir.m == 1)
+    value = (long long)a + b;
+  else if (ir.m == 2)
+    value = (long long)a - b;
+  else if (ir.m == 3)
+    value = (long long)a * b;
+  else if (ir.m == 4)
+  {
+    if (b == 0)
+      return 0;
+    value = (long long)a / b;
+  }
+  else if (ir.m == 11)
+    value = a % 2 != 0;
+  else
+    value = ir.m == 5 ? a == b : ir.m == 6 ? a != b : ir.m == 7 ? a < b : ir.m == 8 ? a <= b : ir.m == 9 ? a > b : a >= b;
+  if (value < -2147483647 - 1 || value > 2147483647)
+    return 0;
+  *result = (int)value;
+  return 1;
+}
 
-  emit(7, 0, 0); // Emit JMP instruction
+// Return the index of the variable at L, M as seen from procedure proc, adding it if it is new
+int tracked_variable(int proc, int l, int m)
+{
+  for (int v = 0; v < num_tracked; v++)
+    if (tracked_proc[v] == proc && tracked_l[v] == l && tracked_m[v] == m)
+      return v;
+  tracked_proc[num_tracked] = proc;
+  tracked_l[num_tracked] = l;
+  tracked_m[num_tracked] = m;
+  return num_tracked++;
+}
 
-  if (atoi(current_token.value) == constsym)
-    const_declaration(); // Parse constants
+// Forget what is known about variable v, along with every copy of it
+void kill_variable(int v, value_kind kind[], int value[])
+{
+  for (int w = 0; w < num_tracked; w++)
+    if (w == v || (kind[w] == copy_value && value[w] == v))
+      kind[w] = unknown_value;
+}
 
-  if (atoi(current_token.value) == varsym)
-    dx += var_declaration(); // Parse variables
+// Return the procedure whose frame is l static links up from procedure proc's frame
+int static_ancestor(int proc, int l)
+{
+  while (l-- > 0 && proc >= 0)
+    proc = proc_parent[proc];
+  return proc;
+}
+
+// Check if procedure proc may store into variable m of procedure owner's frame
+int may_modify(int proc, int owner, int m)
+{
+  for (int k = 0; k < num_modified; k++)
+    if (modified[3 * k] == proc && modified[3 * k + 1] == owner && modified[3 * k + 2] == m)
+      return 1;
+  return 0;
+}
+
+// Find the variables each procedure may store into, including through the procedures it calls
+void find_modified_variables()
+{
+  int capacity = cx + 1;
+  modified = realloc(modified, sizeof(int) * 3 * capacity);
+  num_modified = 0;
+  int *found = NULL, found_capacity = 0; // Pairs (owner, M) that one instruction may store into
+
+  int changed = 1;
+  while (changed)
+  {
+    changed = 0;
+    for (int i = 0; i < cx; i++)
+    {
+      int p = code[i].proc;
+      if (found_capacity < num_modified + 1)
+      {
+        found_capacity = capacity;
+        found = realloc(found, sizeof(int) * 2 * found_capacity);
+      }
+      int n = 0;
+      if (code[i].op == 4)
+      {
+        found[2 * n] = static_ancestor(p, code[i].l);
+        found[2 * n++ + 1] = code[i].m;
+      }
+      else if (code[i].op == 5 || code[i].op == 21)
+      {
+        int callee = code[code[i].m / 3].proc;
+        for (int k = 0; k < num_modified; k++)
+          if (modified[3 * k] == callee)
+          {
+            found[2 * n] = modified[3 * k + 1];
+            found[2 * n++ + 1] = modified[3 * k + 2];
+          }
+      }
+      for (int k = 0; k < n; k++)
+      {
+        if (may_modify(p, found[2 * k], found[2 * k + 1]))
+          continue;
+        if (num_modified == capacity)
+        {
+          capacity *= 2;
+          modified = realloc(modified, sizeof(int) * 3 * capacity);
+        }
+        modified[3 * num_modified] = p;
+        modified[3 * num_modified + 1] = found[2 * k];
+        modified[3 * num_modified++ + 2] = found[2 * k + 1];
+        changed = 1;
+      }
+    }
+  }
+  free(found);
+}
+
+// Record that code[start..end] is to be replaced by length (0 or 1) instructions, superseding
+// any replacement recorded inside it
+void replace_range(int start, int end, int length, instruction with)
+{
+  for (int i = start + 1; i <= end; i++)
+    range_end[i] = -1;
+  range_end[start] = end;
+  range_length[start] = length;
+  range_code[start] = with;
+}
+
+// Apply the replacements recorded by replace_range and relocate jumps, returning 1 if the code changed
+int apply_replacements()
+{
+  instruction *reduced = malloc(sizeof(instruction) * cx);
+  int *new_index = malloc(sizeof(int) * (cx + 1));
+  int nx = 0, changed = 0;
+
+  for (int i = 0; i < cx; i++)
+  {
+    new_index[i] = nx;
+    if (range_end[i] == -1)
+    {
+      reduced[nx++] = code[i];
+      continue;
+    }
+    int end = range_end[i];
+    if (range_length[i] == 1)
+      reduced[nx++] = range_code[i];
+    if (end != i || range_length[i] == 0 || range_code[i].op != code[i].op || range_code[i].l != code[i].l ||
+        range_code[i].m != code[i].m)
+      changed = 1;
+    for (int j = i + 1; j <= end; j++)
+      new_index[j] = new_index[i];
+    i = end;
+  }
+  new_index[cx] = nx;
+
+  for (int j = 0; j < nx; j++)
+    if (is_jump(reduced[j]))
+      reduced[j].m = new_index[reduced[j].m / 3] * 3;
+
+  for (int j = 0; j < nx; j++)
+    code[j] = reduced[j];
+  cx = nx;
+  for (int i = 0; i < cx; i++)
+    range_end[i] = -1;
+  free(reduced);
+  free(new_index);
+  return changed;
+}
+
+// Run the instructions of code[start, end) over the known variable values. When rewrite is set,
+// record loads of known values, constant subexpressions and constant branches for replacement.
+// Return 1 if the block ends in a JPC whose condition is known false (the branch is always taken),
+// 0 if it is known true, and -1 otherwise.
+int propagate_block(int start, int end, value_kind kind[], int value[], int rewrite)
+{
+  value_kind *stack_kind = malloc(sizeof(value_kind) * (end - start));
+  int *stack_value = malloc(sizeof(int) * (end - start)), *stack_start = malloc(sizeof(int) * (end - start));
+  int depth = 0, branch = -1;
+
+  for (int i = start; i < end; i++)
+  {
+    instruction ir = code[i];
+    instruction with = ir;
+
+    if (ir.op == 1) // LIT
+    {
+      stack_kind[depth] = constant_value;
+      stack_value[depth] = ir.m;
+      stack_start[depth++] = i;
+    }
+    else if (ir.op == 3) // LOD
+    {
+      int v = tracked_variable(ir.proc, ir.l, ir.m);
+      stack_kind[depth] = kind[v] == unknown_value ? copy_value : kind[v];
+      stack_value[depth] = kind[v] == unknown_value ? v : value[v];
+      stack_start[depth++] = i;
+      if (rewrite && kind[v] == constant_value)
+      {
+        with.op = 1;
+        with.l = 0;
+        with.m = value[v];
+        replace_range(i, i, 1, with);
+      }
+      else if (rewrite && kind[v] == copy_value)
+      {
+        with.l = tracked_l[value[v]];
+        with.m = tracked_m[value[v]];
+        replace_range(i, i, 1, with);
+      }
+    }
+    else if (ir.op == 4 && depth >= 1) // STO
+    {
+      int v = tracked_variable(ir.proc, ir.l, ir.m);
+      depth--;
+      if (stack_kind[depth] == copy_value && stack_value[depth] == v) // x := x
+        continue;
+      kill_variable(v, kind, value);
+      kind[v] = stack_kind[depth];
+      value[v] = stack_value[depth];
+    }
+    else if (((ir.op == 2 && ir.m != 0) || is_unary_arithmetic(ir)) && depth >= 1)
+    {
+      int unary = ir.op != 2 || ir.m == 11;
+      if (!unary && depth < 2)
+        break;
+      int top = unary ? depth - 1 : depth - 2;
+      int result;
+      if (stack_kind[top] == constant_value && (unary || stack_kind[depth - 1] == constant_value) &&
+          fold_operation(ir, stack_value[top], unary ? 0 : stack_value[depth - 1], &result))
+      {
+        stack_kind[top] = constant_value;
+        stack_value[top] = result;
+        if (rewrite)
+        {
+          with.op = 1;
+          with.l = 0;
+          with.m = result;
+          replace_range(stack_start[top], i, 1, with);
+        }
+      }
+      else
+        stack_kind[top] = unknown_value;
+      depth = top + 1;
+    }
+    else if (ir.op == 5) // CAL: forget the variables the callee may store into
+    {
+      int callee = code[ir.m / 3].proc;
+      for (int v = 0; v < num_tracked; v++)
+        if (tracked_proc[v] == ir.proc && may_modify(callee, static_ancestor(ir.proc, tracked_l[v]), tracked_m[v]))
+          kill_variable(v, kind, value);
+    }
+    else if (ir.op == 8 && depth >= 1) // JPC
+    {
+      depth--;
+      if (stack_kind[depth] == constant_value)
+      {
+        branch = stack_value[depth] == 0;
+        if (rewrite)
+        {
+          with.op = 7;
+          replace_range(stack_start[depth], i, branch, with);
+        }
+      }
+    }
+    else if (ir.op == 9 && ir.m == 1 && depth >= 1) // Write
+      depth--;
+    else if (ir.op == 9 && ir.m == 2) // Read
+    {
+      stack_kind[depth] = unknown_value;
+      stack_start[depth++] = i;
+    }
+    else if (ir.op != 6 && ir.op != 7 && !(ir.op == 2 && ir.m == 0) && ir.op != 9 && ir.op != 21)
+    {
+      // Not an instruction this pass models, so nothing is known after it
+      for (int v = 0; v < num_tracked; v++)
+        kind[v] = unknown_value;
+      depth = 0;
+    }
+  }
+  free(stack_kind);
+  free(stack_value);
+  free(stack_start);
+  return branch;
+}
+
+// Remove instructions no path from the start of the program reaches, and jumps to the next
+// instruction. Return 1 if any were removed.
+int remove_unreachable_code()
+{
+  int *reached = calloc(cx, sizeof(int));
+  int *work = malloc(sizeof(int) * cx);
+  int count = 0;
+  work[count++] = 0;
+  reached[0] = 1;
+  for (int p = 1; object_output && p < num_procs; p++)
+    if (exported_procedure(p))
+    {
+      int i = procedure_entry(p); // Other modules may call exported procedures
+      reached[i] = 1;
+      work[count++] = i;
+    }
+  while (count > 0)
+  {
+    int i = work[--count];
+    instruction ir = code[i];
+    int next[2], n = 0;
+    if (is_jump(ir))
+      next[n++] = ir.m / 3;
+    if (ir.op != 7 && ir.op != 21 && !(ir.op == 2 && ir.m == 0) && !(ir.op == 9 && ir.m == 3) && i + 1 < cx)
+      next[n++] = i + 1;
+    for (int k = 0; k < n; k++)
+      if (next[k] < cx && !reached[next[k]])
+      {
+        reached[next[k]] = 1;
+        work[count++] = next[k];
+      }
+  }
+
+  instruction none = code[0];
+  for (int i = 0; i < cx; i++)
+    if (!reached[i] || (code[i].op == 7 && code[i].m / 3 == i + 1))
+      replace_range(i, i, 0, none);
+  free(reached);
+  free(work);
+  return apply_replacements();
+}
+
+// Propagate constants and copies of variables through the program, folding the expressions and
+// branches that become constant. Known values flow along jumps and are merged where control
+// paths join. Each procedure starts knowing nothing, and a CAL forgets the variables the callee
+// may store into.
+void propagate_constants()
+{
+  reset_code_tables();
+  find_modified_variables();
+
+  for (int pass = 0; pass < 10; pass++)
+  {
+    // Split the code into basic blocks
+    int *leader = calloc(cx + 1, sizeof(int));
+    int *entry = calloc(cx, sizeof(int)); // Program or procedure entry, where nothing is known
+    leader[0] = entry[0] = 1;
+    for (int p = 1; object_output && p < num_procs; p++)
+      if (exported_procedure(p))
+        leader[procedure_entry(p)] = entry[procedure_entry(p)] = 1; // Exported, may be called from outside
+    for (int i = 0; i < cx; i++)
+    {
+      if (is_jump(code[i]))
+        leader[code[i].m / 3] = 1;
+      if (code[i].op == 5 || code[i].op == 21)
+        entry[code[i].m / 3] = 1;
+      if (code[i].op == 7 || code[i].op == 8 || code[i].op == 21 || (code[i].op == 2 && code[i].m == 0) ||
+          (code[i].op == 9 && code[i].m == 3))
+        leader[i + 1] = 1;
+    }
+    int *block_start = malloc(sizeof(int) * (cx + 1)), *block_of = malloc(sizeof(int) * cx), num_blocks = 0;
+    for (int i = 0; i < cx; i++)
+    {
+      if (leader[i])
+        block_start[num_blocks++] = i;
+      block_of[i] = num_blocks - 1;
+    }
+    block_start[num_blocks] = cx;
+
+    num_tracked = 0;
+    for (int i = 0; i < cx; i++)
+      if (code[i].op == 3 || code[i].op == 4)
+        tracked_variable(code[i].proc, code[i].l, code[i].m);
+
+    // Known values on entry to each block, solved by iterating to a fixed point
+    value_kind *in_kind = malloc(sizeof(value_kind) * (num_blocks * num_tracked + 1));
+    int *in_value = malloc(sizeof(int) * (num_blocks * num_tracked + 1));
+    int *visited = calloc(num_blocks, sizeof(int));
+    value_kind *kind = malloc(sizeof(value_kind) * (num_tracked + 1));
+    int *value = malloc(sizeof(int) * (num_tracked + 1));
+    for (int b = 0; b < num_blocks; b++)
+      if (entry[block_start[b]])
+      {
+        visited[b] = 1;
+        for (int v = 0; v < num_tracked; v++)
+          in_kind[b * num_tracked + v] = unknown_value;
+      }
+
+    int changed = 1;
+    while (changed)
+    {
+      changed = 0;
+      for (int b = 0; b < num_blocks; b++)
+      {
+        if (!visited[b])
+          continue;
+        memcpy(kind, in_kind + b * num_tracked, sizeof(value_kind) * num_tracked);
+        memcpy(value, in_value + b * num_tracked, sizeof(int) * num_tracked);
+        int branch = propagate_block(block_start[b], block_start[b + 1], kind, value, 0);
+
+        instruction last = code[block_start[b + 1] - 1];
+        int succ[2], n = 0;
+        if ((last.op == 7 || last.op == 8) && branch != 0)
+          succ[n++] = block_of[last.m / 3];
+        if (last.op != 7 && last.op != 21 && !(last.op == 2 && last.m == 0) && !(last.op == 9 && last.m == 3) &&
+            !(last.op == 8 && branch == 1) && b + 1 < num_blocks)
+          succ[n++] = b + 1;
+
+        for (int k = 0; k < n; k++)
+        {
+          int s = succ[k];
+          if (entry[block_start[s]])
+            continue;
+          value_kind *sk = in_kind + s * num_tracked;
+          int *sv = in_value + s * num_tracked;
+          if (!visited[s])
+          {
+            visited[s] = 1;
+            memcpy(sk, kind, sizeof(value_kind) * num_tracked);
+            memcpy(sv, value, sizeof(int) * num_tracked);
+            changed = 1;
+            continue;
+          }
+          for (int v = 0; v < num_tracked; v++) // Merge at the join
+            if (sk[v] != unknown_value && (sk[v] != kind[v] || sv[v] != value[v]))
+            {
+              sk[v] = unknown_value;
+              changed = 1;
+            }
+        }
+      }
+    }
+
+    for (int b = 0; b < num_blocks; b++)
+      if (visited[b])
+      {
+        memcpy(kind, in_kind + b * num_tracked, sizeof(value_kind) * num_tracked);
+        memcpy(value, in_value + b * num_tracked, sizeof(int) * num_tracked);
+        propagate_block(block_start[b], block_start[b + 1], kind, value, 1);
+      }
+    free(in_kind);
+    free(in_value);
+    free(visited);
+    free(kind);
+    free(value);
+    free(leader);
+    free(entry);
+    free(block_start);
+    free(block_of);
+
+    int rewritten = apply_replacements();
+    if (!remove_unreachable_code() && !rewritten)
+      break;
+  }
+}
+
+// Check if an instruction loads or stores the variable at its L, M
+int accesses_variable(instruction i)
+{
+  return i.op == 3 || i.op == 4 || i.op == 10 || i.op == 11;
+}
+
+// Find the instructions of the same procedure that can run right after code[i], returning how many
+int next_instructions(int i, int next[2])
+{
+  instruction ir = code[i];
+  int n = 0;
+  if (is_jump(ir) && ir.op != 5 && ir.op != 21)
+    next[n++] = ir.m / 3;
+  if (ir.op != 7 && ir.op != 21 && !(ir.op == 2 && ir.m == 0) && !(ir.op == 9 && ir.m == 3) && i + 1 < cx)
+    next[n++] = i + 1;
+  return n;
+}
+
+// Renumber the variable slots of each frame so that variables whose values are never live at the
+// same time share a slot, and variables that are never used get none. Liveness is solved over the
+// procedure's own instructions. A slot that a nested procedure reaches through its static link
+// keeps a slot of its own, because a call may read or store it at any time.
+void compact_frames()
+{
+  for (int p = 0; p < num_procs; p++)
+  {
+    frame_before[p] = frame_after[p] = 0;
+    int inc = frame_inc_index(p);
+    if (inc == -1 || external_index(p) != -1)
+      continue;
+    int slots = code[inc].m;
+    frame_before[p] = frame_after[p] = slots;
+
+    // Find the slots in use, and those reached from nested procedures
+    char *used = calloc(slots, 1), *pinned = calloc(slots, 1);
+    int *member = malloc(sizeof(int) * cx), *position = malloc(sizeof(int) * cx);
+    int n = 0, valid = 1;
+    for (int i = 0; i < cx; i++)
+    {
+      position[i] = -1;
+      if (code[i].proc == p)
+      {
+        position[i] = n;
+        member[n++] = i;
+      }
+      if (!accesses_variable(code[i]) || static_ancestor(code[i].proc, code[i].l) != p)
+        continue;
+      if (code[i].m < 3 || code[i].m >= slots)
+        valid = 0;
+      else
+      {
+        used[code[i].m] = 1;
+        pinned[code[i].m] |= code[i].l > 0;
+      }
+    }
+
+    // Live slots before each instruction, solved backwards to a fixed point
+    char *live_in = calloc((size_t)n * slots, 1), *live_out = malloc(slots);
+    char *interferes = calloc((size_t)slots * slots, 1);
+    int changed = 1, final = 0;
+    while (valid && (changed || !final))
+    {
+      final = !changed; // One more pass once nothing changes, recording interference
+      changed = 0;
+      for (int k = n - 1; k >= 0; k--)
+      {
+        int i = member[k], next[2];
+        memset(live_out, 0, slots);
+        for (int s = 0, c = next_instructions(i, next); s < c; s++)
+          if (position[next[s]] != -1)
+            for (int v = 0; v < slots; v++)
+              live_out[v] |= live_in[(size_t)position[next[s]] * slots + v];
+
+        int own = accesses_variable(code[i]) && code[i].l == 0 && !pinned[code[i].m];
+        int def = own && code[i].op != 3 ? code[i].m : -1;
+        int use = own && code[i].op != 4 ? code[i].m : -1;
+        if (final && def != -1) // A store clobbers its slot, so it must not hold anything still live
+          for (int v = 0; v < slots; v++)
+            if (live_out[v] && v != def)
+              interferes[def * slots + v] = interferes[v * slots + def] = 1;
+
+        char *in = live_in + (size_t)k * slots;
+        for (int v = 0; v < slots; v++)
+        {
+          char live = v == use || (live_out[v] && v != def);
+          if (in[v] != live)
+          {
+            in[v] = live;
+            changed = 1;
+          }
+        }
+      }
+    }
+    for (int a = 0; valid && a < slots; a++) // Values read before any store all arrive with the frame
+      for (int b = 0; b < slots; b++)
+        if (a != b && live_in[a] && live_in[b])
+          interferes[a * slots + b] = 1;
+
+    // Give pinned slots their own colors, then color the rest greedily in slot order
+    int *color = malloc(sizeof(int) * slots), colors = 0;
+    for (int s = 0; s < slots; s++)
+      color[s] = used[s] && pinned[s] ? colors++ : -1;
+    int pinned_colors = colors;
+    for (int s = 0; s < slots; s++)
+      if (used[s] && !pinned[s])
+      {
+        int c = pinned_colors;
+        for (int t = 0; t < slots; t++)
+          if (color[t] == c && interferes[s * slots + t])
+          {
+            c++;
+            t = -1; // Check the next color against every slot
+          }
+        color[s] = c;
+        if (c >= colors)
+          colors = c + 1;
+      }
+
+    if (valid && 4 + colors < slots) // Links, colored slots and the spare slot
+    {
+      for (int i = 0; i < cx; i++)
+        if (accesses_variable(code[i]) && static_ancestor(code[i].proc, code[i].l) == p)
+          code[i].m = 3 + color[code[i].m];
+      code[inc].m = frame_after[p] = 4 + colors;
+    }
+    free(used);
+    free(pinned);
+    free(member);
+    free(position);
+    free(live_in);
+    free(live_out);
+    free(interferes);
+    free(color);
+  }
+}
 
-  while (atoi(current_token.value) == procsym)
-    procedure(); // Parse procedures
+// Print the frame size of each procedure before and after compaction
+void print_frame_report()
+{
+  print_both("\nFrame Compaction:\n");
+  print_both("%12s %6s %10s %12s\n", "Procedure", "Frame", "Compacted", "Bytes Saved");
+  for (int p = 0; p < num_procs; p++)
+    if (frame_before[p] > 0)
+      print_both("%12s %6d %10d %12d\n", proc_names[p], frame_before[p], frame_after[p],
+                 (frame_before[p] - frame_after[p]) * (int)sizeof(int));
+}
 
-  code[jx].m = cx * 3; // Set JMP instruction's M to current code index
-  emit(6, 0, dx);      // Emit INC instruction
+// Return the index of the last instruction of procedure proc, its RTN. The procedures nested in it
+// lie between its entry and this index.
+int procedure_end(int proc)
+{
+  for (int i = cx - 1; i >= 0; i--)
+    if (code[i].proc == proc)
+      return i;
+  return -1;
+}
 
-  statement(); // Parse statement
+// Return instruction i of code[start..end] with a jump or call into the range addressed relative to
+// start. A jump out of the range keeps its address, as a negative M so the two cannot match.
+instruction normalized_instruction(int i, int start, int end)
+{
+  instruction ir = code[i];
+  if (is_jump(ir))
+    ir.m = ir.m / 3 >= start && ir.m / 3 <= end ? ir.m / 3 - start : -1 - ir.m / 3;
+  return ir;
+}
 
-  if (level > 0)
+// Hash code[start..end] with the addresses inside it relative to start (FNV-1a)
+unsigned int hash_code_range(int start, int end)
+{
+  unsigned int hash = 2166136261u;
+  for (int i = start; i <= end; i++)
   {
-    emit(2, 0, 0); // Emit RTN instruction
+    instruction ir = normalized_instruction(i, start, end);
+    int fields[3] = {ir.op, ir.l, ir.m};
+    for (int f = 0; f < 3; f++)
+      hash = (hash ^ (unsigned int)fields[f]) * 16777619u;
   }
+  return hash;
+}
 
-  tx = prev_tx; // Reset symbol table index
-  level--;      // Decrement level
+// Check if code[a..a + length) and code[b..b + length) are the same once addresses inside each
+// are taken relative to its start
+int same_code_range(int a, int b, int length)
+{
+  for (int i = 0; i < length; i++)
+  {
+    instruction x = normalized_instruction(a + i, a, a + length - 1);
+    instruction y = normalized_instruction(b + i, b, b + length - 1);
+    if (x.op != y.op || x.l != y.l || x.m != y.m)
+      return 0;
+  }
+  return 1;
 }
 
-void procedure()
+// Give procedures whose code is identical one body. Each procedure's code, with the procedures
+// nested in it, is hashed with the addresses inside it taken relative to its entry. A procedure
+// that matches an earlier one with the same enclosing procedure, so its calls pass the same static
+// link, has its calls redirected to the earlier one and its code removed. Callers may become
+// identical in turn, so this repeats until nothing changes.
+void fold_identical_procedures()
 {
-  while (atoi(current_token.value) == procsym)
+  int *start = malloc(sizeof(int) * num_procs), *end = malloc(sizeof(int) * num_procs);
+  unsigned int *hash = malloc(sizeof(unsigned int) * num_procs);
+  for (int p = 0; p < num_procs; p++)
+    folded_into[p] = -1;
+  reset_code_tables();
+
+  int changed = 1;
+  while (changed)
   {
-    get_next_token();
-    if (atoi(current_token.value) != identsym) // Check if next token is an identifier
+    changed = 0;
+    for (int p = 1; p < num_procs; p++)
     {
-      error(2); // Error if it isn't
+      start[p] = external_index(p) == -1 ? procedure_entry(p) : -1; // Leave stubs to the linker
+      end[p] = procedure_end(p);
+      if (start[p] != -1)
+        hash[p] = hash_code_range(start[p], end[p]);
     }
 
-    add_symbol(3, current_token.lexeme, 0, level, cx * 3, 0); // Add procedure to symbol table
-    get_next_token();
-    if (atoi(current_token.value) != semicolonsym) // Check if next token is a semicolon
+    for (int q = 2; q < num_procs; q++)
     {
-      error(6); // Error if it isn't
+      if (start[q] == -1 || (object_output && exported_procedure(q))) // Other modules call it by name
+        continue;
+      int length = end[q] - start[q] + 1;
+      for (int p = 1; p < q; p++)
+        if (start[p] != -1 && folded_into[p] == -1 && proc_parent[p] == proc_parent[q] && hash[p] == hash[q] &&
+            end[p] - start[p] + 1 == length && same_code_range(start[p], start[q], length))
+        {
+          for (int i = 0; i < cx; i++)
+            if ((code[i].op == 5 || code[i].op == 21) && code[i].m / 3 == start[q])
+              code[i].m = code_address(start[p]);
+          folded_into[q] = p;
+          folded_length[q] = length;
+          changed = 1;
+          break;
+        }
     }
+    if (changed)
+      remove_unreachable_code(); // The folded procedures are no longer called
+  }
+  free(start);
+  free(end);
+  free(hash);
+}
 
-    get_next_token();
+// Print the procedures that share another procedure's code
+void print_folding_report()
+{
+  int any = 0;
+  for (int p = 0; p < num_procs; p++)
+    any |= folded_into[p] != -1;
+  if (!any)
+    return;
+  print_both("\nIdentical Procedures:\n");
+  print_both("%12s %12s %13s\n", "Procedure", "Folded Into", "Instructions");
+  for (int p = 0; p < num_procs; p++)
+    if (folded_into[p] != -1)
+      print_both("%12s %12s %13d\n", proc_names[p], proc_names[folded_into[p]], folded_length[p]);
+}
 
-    block();                                       // Parse block
-    if (atoi(current_token.value) != semicolonsym) // Check if next token is a semicolon
+// Return how many stack cells an instruction pushes, less those it pops
+int stack_change(instruction ir)
+{
+  switch (ir.op)
+  {
+  case 1: // LIT
+  case 3: // LOD
+    return 1;
+  case 2: // OPR
+    return ir.m >= 1 && ir.m <= 10 ? -1 : 0;
+  case 4:  // STO
+  case 8:  // JPC
+  case 10: // LAS
+    return -1;
+  case 6: // INC
+    return ir.m;
+  case 9: // SYS
+    return ir.m == 1 ? -1 : ir.m == 2;
+  default:
+    return ir.op >= 12 && ir.op <= 17 ? -1 : 0; // Compare-branches pop their operand
+  }
+}
+
+// Follow every path through procedure proc from its entry, recording the stack cells in use above
+// its frame base before each instruction, and find its frame size and deepest stack
+void measure_procedure(int proc)
+{
+  int inc = frame_inc_index(proc), entry = procedure_entry(proc);
+  proc_frame[proc] = inc != -1 ? code[inc].m : 0;
+  proc_peak[proc] = proc_frame[proc];
+  if (entry == -1)
+    return;
+
+  int *work = malloc(sizeof(int) * cx), count = 0;
+  analysis_depth[entry] = 0;
+  work[count++] = entry;
+  while (count > 0)
+  {
+    int i = work[--count], next[2];
+    int depth = analysis_depth[i] + stack_change(code[i]);
+    if (depth > proc_peak[proc])
+      proc_peak[proc] = depth;
+    for (int s = 0, n = next_instructions(i, next); s < n; s++)
+      if (code[next[s]].proc == proc && analysis_depth[next[s]] == -1)
+      {
+        analysis_depth[next[s]] = depth;
+        work[count++] = next[s];
+      }
+  }
+  free(work);
+}
+
+// Return the longest path, in instructions, from code[start] to code[end] through the instructions
+// of start's procedure in between. Backward jumps are not followed, so each loop body counts once.
+// A call adds the callee's longest path. Set *bounded to 0 if a call on the path can recurse.
+int longest_path(int start, int end, int *bounded)
+{
+  int *cost = malloc(sizeof(int) * (end + 1));
+  char *exact = malloc(end + 1);
+  for (int i = end; i >= start; i--)
+  {
+    cost[i] = -1; // Not reachable from start's procedure
+    if (code[i].proc != code[start].proc)
+      continue;
+    int best = 0, next[2];
+    exact[i] = 1;
+    for (int s = 0, n = i < end ? next_instructions(i, next) : 0; s < n; s++)
+      if (next[s] > i && next[s] <= end && cost[next[s]] != -1)
+      {
+        if (cost[next[s]] > best)
+          best = cost[next[s]];
+        exact[i] &= exact[next[s]];
+      }
+    cost[i] = 1 + best;
+    if (code[i].op == 5 || code[i].op == 21)
     {
-      error(6); // Error if it isn't
+      int callee = code[code[i].m / 3].proc;
+      cost[i] += proc_cost[callee];
+      exact[i] &= proc_total[callee] != -1;
     }
-    get_next_token();
   }
+  int result = cost[start];
+  *bounded = exact[start];
+  free(cost);
+  free(exact);
+  return result;
 }
 
-// Parse constants
-void const_declaration()
+// Work out the stack cells a call of procedure proc needs, including everything it calls, and its
+// longest path. proc_state is 0 before a procedure is visited, 1 while it is on the current call
+// chain, and 2 when done. A procedure that can recurse gets proc_total -1.
+void analyze_calls(int proc)
 {
-  char name[MAX_IDENTIFIER_LENGTH + 1]; // Track name of constant
-                                        // Check if current token is a const
-  do
-  {
-    get_next_token();
-    if (atoi(current_token.value) != identsym) // Check if next token is an identifier
+  proc_state[proc] = 1;
+  proc_total[proc] = proc_peak[proc];
+  proc_cost[proc] = 0;
+  for (int i = 0; i < cx; i++)
+    if (code[i].proc == proc && analysis_depth[i] != -1 && (code[i].op == 5 || code[i].op == 21))
     {
-      error(2); // Error if it isn't
+      int callee = code[code[i].m / 3].proc;
+      if (proc_state[callee] == 0)
+        analyze_calls(callee);
+      if (proc_state[callee] == 1 || proc_total[callee] == -1)
+        proc_total[proc] = -1; // Recursion
+      else if (proc_total[proc] != -1)
+      {
+        int need = (code[i].op == 5 ? analysis_depth[i] : 0) + proc_total[callee]; // A tail call reuses this frame
+        if (need > proc_total[proc])
+          proc_total[proc] = need;
+      }
     }
-    strcpy(name, current_token.lexeme);                    // Save name of constant
-    if (check_symbol_table(current_token.lexeme, 1) != -1) // Check if constant has already been declared
+  int entry = procedure_entry(proc), bounded;
+  if (entry != -1)
+    proc_cost[proc] = longest_path(entry, cx - 1, &bounded);
+  proc_state[proc] = 2;
+}
+
+// Check if procedure from can reach procedure to through one or more calls
+int calls_reach(int from, int to, char *visited)
+{
+  visited[from] = 1;
+  for (int i = 0; i < cx; i++)
+    if (code[i].proc == from && analysis_depth[i] != -1 && (code[i].op == 5 || code[i].op == 21))
     {
-      error(3); // Error if it has
+      int callee = code[code[i].m / 3].proc;
+      if (callee == to || (!visited[callee] && calls_reach(callee, to, visited)))
+        return 1;
     }
-    get_next_token();
-    if (atoi(current_token.value) != eqsym) // Check if next token is an equals sign
+  return 0;
+}
+
+// Print each procedure's frame, operand stack and instruction count, the stack each call chain
+// needs, the recursive procedures, and the cost of one iteration of each loop. Costs count the
+// instructions on the longest path, taking each nested loop once and adding the callee's cost for
+// each call. A cost marked + calls a procedure that can recurse, so it is only a lower bound.
+void print_analysis_report()
+{
+  reset_code_tables();
+  for (int i = 0; i < cx; i++)
+    analysis_depth[i] = -1;
+  for (int p = 0; p < num_procs; p++)
+  {
+    measure_procedure(p);
+    proc_state[p] = 0;
+  }
+  for (int p = 0; p < num_procs; p++)
+    if (proc_state[p] == 0)
+      analyze_calls(p);
+
+  print_both("\nStack and Cost Analysis:\n");
+  print_both("%12s %6s %9s %13s %7s %10s\n", "Procedure", "Frame", "Operands", "Instructions", "Stack", "Path Cost");
+  for (int p = 0; p < num_procs; p++)
+  {
+    int instructions = 0;
+    for (int i = 0; i < cx; i++)
+      instructions += code[i].proc == p;
+    char stack[16], cost[16];
+    snprintf(stack, sizeof(stack), proc_total[p] == -1 ? "-" : "%d", proc_total[p]);
+    snprintf(cost, sizeof(cost), proc_total[p] == -1 ? "%d+" : "%d", proc_cost[p]);
+    print_both("%12s %6d %9d %13d %7s %10s\n", proc_names[p], proc_frame[p], proc_peak[p] - proc_frame[p],
+               instructions, stack, cost);
+  }
+
+  // Procedures that reach each other through calls form one recursive cycle
+  char *visited = malloc(proc_capacity), *reported = calloc(proc_capacity, sizeof(char));
+  for (int p = 0; p < num_procs; p++)
+  {
+    if (reported[p] || !calls_reach(p, p, memset(visited, 0, num_procs)))
+      continue;
+    print_both("Recursive: %s", proc_names[p]);
+    for (int q = p + 1; q < num_procs; q++)
+      if (!reported[q] && calls_reach(p, q, memset(visited, 0, num_procs)) &&
+          calls_reach(q, p, memset(visited, 0, num_procs)))
+      {
+        print_both(", %s", proc_names[q]);
+        reported[q] = 1;
+      }
+    print_both("\n");
+  }
+  free(visited);
+  free(reported);
+  if (proc_total[0] == -1)
+    print_both("Maximum stack depth: unbounded, the program can recurse\n");
+  else
+    print_both("Maximum stack depth: %d cells (%d bytes)\n", proc_total[0], proc_total[0] * (int)sizeof(int));
+
+  // A backward jump closes a loop whose body runs from its target
+  int loops = 0;
+  for (int b = 0; b < cx; b++)
+  {
+    if (!is_jump(code[b]) || code[b].op == 5 || code[b].op == 21 || code[b].m / 3 > b ||
+        analysis_depth[b] == -1)
+      continue;
+    int top = code[b].m / 3, line = code[b].line, bounded;
+    for (int i = 0; i <= b; i++) // The loop's first source line, which holds the while, or its guard's
+      if (code[i].proc == code[b].proc && code[i].line > 0 && code[i].line < line &&
+          (i >= top || ((code[i].op == 8 || (code[i].op >= 12 && code[i].op <= 17)) && code[i].m / 3 == b + 1)))
+        line = code[i].line;
+    int cost = longest_path(top, b, &bounded);
+    if (loops++ == 0)
+      print_both("\n%12s %6s %19s\n", "Procedure", "Line", "Cost per Iteration");
+    char text[16];
+    snprintf(text, sizeof(text), bounded ? "%d" : "%d+", cost);
+    print_both("%12s %6d %19s\n", proc_names[code[b].proc], line, text);
+  }
+
+  // Instructions of each opcode, to set against the VM's executed opcode mix (-m)
+  int emitted[22] = {0};
+  for (int i = 0; i < cx; i++)
+    if (code[i].op >= 1 && code[i].op <= 21)
+      emitted[code[i].op]++;
+  print_both("\n%4s %4s %8s\n", "OP", "Name", "Emitted");
+  for (int op = 1; op <= 21; op++)
+    if (emitted[op] > 0)
     {
-      error(4); // Error if it isn't
+      char name[4];
+      get_op_name(op, name);
+      print_both("%4d %4s %8d\n", op, name, emitted[op]);
     }
-    get_next_token();
-    if (atoi(current_token.value) != numbersym) // Check if next token is a number
+}
+
+// Return the placeholder CAL address of the external procedure name, adding it if it is new.
+// emit_external_stubs() replaces it with the address of the procedure's stub.
+int external_address(char *name)
+{
+  int k = 0;
+  while (k < num_externals && strcmp(external_names[k], name) != 0)
+    k++;
+  if (k == num_externals)
+  {
+    if (num_externals == external_capacity)
     {
-      error(5); // Error if it isn't
+      external_capacity = external_capacity == 0 ? 16 : external_capacity * 2;
+      external_names = realloc(external_names, sizeof(*external_names) * external_capacity);
+      external_proc = realloc(external_proc, sizeof(int) * external_capacity);
     }
-    add_symbol(1, name, atoi(current_token.lexeme), level, 0, 0); // Add constant to symbol table
-    get_next_token();
-  } while (atoi(current_token.value) == commasym); // Continue parsing constants if next token is a comma
-  if (atoi(current_token.value) != semicolonsym)   // Check if next token is a semicolon
+    strcpy(external_names[num_externals++], name);
+  }
+  return -3 * (k + 1);
+}
+
+// Return the external procedure whose stub is procedure proc, or -1
+int external_index(int proc)
+{
+  for (int k = 0; k < num_externals; k++)
+    if (external_proc[k] == proc)
+      return k;
+  return -1;
+}
+
+// Check if procedure proc is a top-level procedure other modules can call
+int exported_procedure(int proc)
+{
+  return proc > 0 && proc_parent[proc] == 0 && external_index(proc) == -1 && procedure_entry(proc) != -1;
+}
+
+// Return the code index where procedure proc is entered (its JMP, or its INC once a JMP to the next
+// instruction is removed), or -1 if it has no code
+int procedure_entry(int proc)
+{
+  for (int i = 0; i < cx; i++)
+    if (code[i].proc == proc)
+      return i;
+  return -1;
+}
+
+// Return the number of blocks procedure proc is nested in
+int procedure_depth(int proc)
+{
+  int depth = 0;
+  for (int p = proc; proc_parent[p] != -1; p = proc_parent[p])
+    depth++;
+  return depth;
+}
+
+// Add a stub procedure after the HALT for each external procedure and point the external calls at
+// it. A stub calls every exported procedure, because the external procedure may call back into
+// this module, so the optimizer treats an external call as storing what those procedures store.
+// The linker drops the stubs.
+void emit_external_stubs()
+{
+  int num_defined = num_procs;
+  int *entry = malloc(sizeof(int) * num_defined);
+  for (int p = 0; p < num_defined; p++)
+    entry[p] = procedure_entry(p);
+
+  int *stub = malloc(sizeof(int) * num_externals);
+  for (int k = 0; k < num_externals; k++)
   {
-    error(6); // Error if it isn't
+    current_proc = external_proc[k] = new_procedure(external_names[k], 0);
+    stub[k] = cx;
+    emit(6, 0, 4); // Emit INC instruction
+    for (int p = 1; p < num_defined; p++)
+      if (proc_parent[p] == 0)
+        emit(5, 1, code_address(entry[p])); // Emit CAL instruction
+    emit(2, 0, 0); // Emit RTN instruction
   }
-  get_next_token();
+  current_proc = 0;
+
+  for (int i = 0; i < cx; i++)
+    if ((code[i].op == 5 || code[i].op == 21) && code[i].m < 0)
+      code[i].m = code_address(stub[-code[i].m / 3 - 1]);
+  free(entry);
+  free(stub);
 }
 
-// Parse variables
-int var_declaration()
+// Write the program as a relocatable object. The main statement, without its INC and HALT, is a
+// section of its own so the linker can run the main statements of all modules in turn, and each
+// M that depends on where code or data ends up carries a relocation:
+//   p  offset in this module's procedure section     x  index of an external procedure
+//   b  offset in this module's main section          d  slot in the shared main frame
+//   -  none
+void write_object(FILE *f)
 {
-  int num_vars = 0; // Track number of variables
-  do
+  int start = code[0].op == 7 && code[0].proc == 0; // Skip main's JMP, the linker writes its own
+  int inc = frame_inc_index(0);
+  int end = inc + 1;
+  while (end < cx && code[end].proc == 0)
+    end++;
+  int halt = end - 1;
+  if (!(code[halt].op == 9 && code[halt].m == 3))
+    halt = end; // Main never finishes, so its HALT was removed
+
+  fprintf(f, "PL/0 object\n");
+  fprintf(f, "frame %d\n", code[inc].m);
+  fprintf(f, "externals %d\n", num_externals);
+  for (int k = 0; k < num_externals; k++)
+    fprintf(f, "%s\n", external_names[k]);
+
+  int num_exports = 0;
+  for (int p = 1; p < num_procs; p++)
+    num_exports += exported_procedure(p);
+  fprintf(f, "exports %d\n", num_exports);
+  for (int p = 1; p < num_procs; p++)
+    if (exported_procedure(p))
+      fprintf(f, "%s %d\n", proc_names[p], procedure_entry(p) - start);
+
+  for (int section = 0; section < 2; section++)
   {
-    num_vars++; // Increment number of variables
-    get_next_token();
-    if (atoi(current_token.value) != identsym) // Check if next token is an identifier
-    {
-      error(2);
-    }
-    if (check_symbol_table(current_token.lexeme, 1) != -1) // Check if variable has already been declared
+    int from = section == 0 ? start : inc + 1;
+    int to = section == 0 ? inc : halt;
+    fprintf(f, "%s %d\n", section == 0 ? "procedures" : "main", to - from);
+    for (int i = from; i < to; i++)
     {
-      error(3); // Error if it has
+      instruction ir = code[i];
+      char reloc = '-';
+      if (is_jump(ir))
+      {
+        int target = ir.m / 3;
+        if (target < cx && external_index(code[target].proc) != -1)
+        {
+          reloc = 'x';
+          ir.m = external_index(code[target].proc);
+        }
+        else if (target < inc)
+        {
+          reloc = 'p';
+          ir.m = target - start;
+        }
+        else
+        {
+          reloc = 'b';
+          ir.m = target - (inc + 1);
+        }
+      }
+      else if ((ir.op == 3 || ir.op == 4 || ir.op == 10 || ir.op == 11) && ir.l == procedure_depth(ir.proc))
+        reloc = 'd';
+      fprintf(f, "%d %d %d %c\n", ir.op, ir.l, ir.m, reloc);
     }
-    add_symbol(2, current_token.lexeme, 0, level, num_vars + 2, 0); // Add variable to symbol table
+  }
+}
 
+// Put the parser and code generator back to the start of the program
+void reset_parser()
+{
+  cx = tx = prev_tx = 0;
+  level = -1;
+  dx = 4;
+  code_base = 0;
+  num_procs = current_proc = last_line = 0;
+  num_open = num_pending = 0;
+  token_cursor = 0;
+  memset(&current_token, 0, sizeof(current_token));
+}
+
+// Record what a code generation thread needs to generate the current block's statement, then skip
+// the statement. It ends at a ';' or '.' outside any begin-end, at an end without a begin, or at
+// the end of input; generate_body() checks that the parser agrees.
+void declare_body()
+{
+  body_job *job = &jobs[current_proc];
+  job->cursor = token_cursor - (atoi(current_token.value) != 0); // Not past the end of input
+  job->last_line = last_line;
+  job->level = level;
+  job->dx = dx;
+  job->tx = tx;
+  job->symbols = malloc((tx + 1) * sizeof(symbol));
+  memcpy(job->symbols, symbol_table, tx * sizeof(symbol));
+
+  int depth = 0; // Open begins
+  while (atoi(current_token.value) != 0)
+  {
+    int sym = atoi(current_token.value);
+    if (depth == 0 && (sym == semicolonsym || sym == periodsym))
+      break;
+    if (sym == endsym && depth-- == 0)
+      break;
+    if (sym == beginsym)
+      depth++;
     get_next_token();
-  } while (atoi(current_token.value) == commasym); // Continue parsing variables if next token is a comma
-  if (atoi(current_token.value) != semicolonsym)   // Check if next token is a semicolon
+  }
+  job->end_cursor = token_cursor;
+  job->end_symbol = atoi(current_token.value);
+}
+
+// Generate one block's JMP, INC, statement and RTN into this thread's code array, with code
+// addresses relative to the JMP and procedure ids in place of CAL addresses
+void generate_body(body_job *job)
+{
+  if (setjmp(parallel_abort) != 0)
   {
-    error(6); // Error if it isn't
+    job->failed = 1;
+    return;
   }
-  get_next_token();
 
-  return num_vars; // Return number of variables
+  reserve_symbols(job->tx);
+  memcpy(symbol_table, job->symbols, job->tx * sizeof(symbol));
+  tx = prev_tx = job->tx;
+  level = job->level;
+  dx = job->dx;
+  current_proc = job - jobs;
+  cx = code_base = 0;
+  num_open = num_pending = 0; // A failed job may have left its stacks part full
+  current_token.line = job->last_line; // End of input keeps the line of the token before it
+  token_cursor = job->cursor;
+  get_next_token(); // Reread the statement's first token
+  last_line = job->last_line;
+
+  emit(7, 0, 0); // Emit JMP instruction, pointed at the INC when linking
+  code[0].line = job->jmp_line;
+  block_body();
+
+  if (token_cursor != job->end_cursor || atoi(current_token.value) != job->end_symbol)
+  {
+    job->failed = 1; // The statement does not end where the declaration pass thought
+    return;
+  }
+  job->size = cx;
+  job->code = malloc(cx * sizeof(instruction));
+  memcpy(job->code, code, cx * sizeof(instruction));
 }
 
-// Parse statements
-void statement()
+// Generate blocks until none are left
+void *generation_thread(void *arg)
 {
-  if (atoi(current_token.value) == identsym) // Check if current token is an identifier
+  speculating = 1;
+  for (int p = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED); p < num_procs;
+       p = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED))
+    generate_body(&jobs[p]);
+  free(symbol_table); // The parser tables are this thread's own
+  free(code);
+  free(open_statements);
+  free(pending);
+  return arg;
+}
+
+// Lay out procedure proc the way the serial compiler emits it: its JMP, its nested procedures,
+// then its statement. Bodies are appended to order as they are placed.
+void place_block(int proc, int *next, int *jmp_pos, int *inc_pos, int *order, int *num_ordered)
+{
+  jmp_pos[proc] = (*next)++;
+  for (int p = proc + 1; p < num_procs; p++)
+    if (proc_parent[p] == proc)
+      place_block(p, next, jmp_pos, inc_pos, order, num_ordered);
+  inc_pos[proc] = *next;
+  *next += jobs[proc].size - 1;
+  order[(*num_ordered)++] = proc;
+}
+
+// Join the generated blocks into the program the serial compiler would have produced, writing
+// the finished procedures to the code file when streaming
+void link_bodies()
+{
+  int *jmp_pos = malloc(sizeof(int) * num_procs), *inc_pos = malloc(sizeof(int) * num_procs);
+  int *order = malloc(sizeof(int) * num_procs);
+  int total = 0, num_ordered = 0;
+  place_block(0, &total, jmp_pos, inc_pos, order, &num_ordered);
+
+  // When streaming, everything up to the end of the last procedure to finish is written out
+  int segment = 0; // Address index of the first instruction not yet written to the code file
+  for (int i = 0; i < num_ordered; i++)
+    if (streaming && order[i] != 0)
+      segment = inc_pos[order[i]] + jobs[order[i]].size - 1;
+
+  instruction *linked = malloc(total * sizeof(instruction));
+  int *padded = calloc(total, sizeof(int)); // Block JMPs written before they are patched
+  for (int p = 0; p < num_procs; p++)
   {
-    int sx = check_symbol_table(current_token.lexeme, 0); // Check if identifier is in symbol table
-    if (sx == -1)
-    {
-      error(7); // Error if it isn't
-    }
-    if (symbol_table[sx].kind != 2) // Check if identifier is a variable
-    {
-      error(8); // Error if it isn't
-    }
-    get_next_token();
-    if (atoi(current_token.value) != becomessym) // Check if next token is a becomes symbol (:=)
+    if (p > 0)
+      padded[jmp_pos[proc_parent[p]]] = 1;
+    for (int k = 0; k < jobs[p].size; k++)
     {
-      error(9); // Error if it isn't
+      instruction ir = jobs[p].code[k];
+      if (k == 0)
+        ir.m = inc_pos[p] * 3; // Block JMP to the INC
+      else if (ir.op == 5 || ir.op == 21)
+        ir.m = jmp_pos[ir.m] * 3; // Call by procedure id
+      else if (ir.op == 7 || ir.op == 8)
+        ir.m = (inc_pos[p] + ir.m / 3 - 1) * 3;
+      linked[k == 0 ? jmp_pos[p] : inc_pos[p] + k - 1] = ir;
     }
-    get_next_token();
-    expression();                                                   // Parse expression
-    emit(4, level - symbol_table[sx].level, symbol_table[sx].addr); // Emit STO instruction
   }
-  else if (atoi(current_token.value) == callsym)
+
+  for (int i = 0; i < segment; i++)
   {
+    if (padded[i])
+      fprintf(elf_file, "%d %d %-10d\n", linked[i].op, linked[i].l, linked[i].m); // As flush_code() writes it
+    else
+      fprintf(elf_file, "%d %d %d\n", linked[i].op, linked[i].l, linked[i].m);
+    if (debug_info)
+      fprintf(map_file, "%d %d\n", linked[i].line, linked[i].proc);
+  }
+  reserve_code(total - segment);
+  memcpy(code, linked + segment, (total - segment) * sizeof(instruction));
+  code_base = segment;
+  cx = total - segment;
+
+  free(jmp_pos);
+  free(inc_pos);
+  free(order);
+  free(linked);
+  free(padded);
+}
+
+// Parse the declarations, generate every block's statement on parallel_threads threads and link
+// the results. Return 0 if the serial compiler has to compile the program instead, which it
+// does for any program with an error so errors are reported exactly as before.
+int generate_in_parallel()
+{
+  int linked = 0;
+  speculating = declaring = 1;
+  if (setjmp(parallel_abort) == 0)
+  {
+    new_procedure("main", -1);
     get_next_token();
-    if (atoi(current_token.value) != identsym) // Check if next token is an identifier
-    {
-      error(17); // Error if it isn't
-    }
-    int i = check_symbol_table(current_token.lexeme, 0); // Check if identifier is in symbol table
-    if (i == -1)
-    {
-      error(7); // Error if it isn't
-    }
-    if (symbol_table[i].kind != 3) // Check if identifier is a procedure
+    block(); // Parse declarations only
+    declaring = 0;
+
+    if (atoi(current_token.value) == periodsym)
     {
-      error(18); // Error if it isn't
+      int num_threads = parallel_threads < num_procs ? parallel_threads : num_procs;
+      pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+      int started = 0;
+      next_job = 0;
+      while (started < num_threads && pthread_create(&threads[started], NULL, generation_thread, NULL) == 0)
+        started++;
+      for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+      free(threads);
+
+      int failed = started == 0;
+      for (int p = 0; p < num_procs; p++)
+        failed |= jobs[p].failed;
+      if (!failed)
+        link_bodies();
+      linked = !failed;
     }
-    emit(5, level - symbol_table[i].level, symbol_table[i].addr); // Emit CAL instruction
-    get_next_token();
   }
-  else if (atoi(current_token.value) == beginsym) // Check if current token is a begin
+  speculating = declaring = 0;
+
+  for (int p = 0; p < num_procs; p++)
+  {
+    free(jobs[p].symbols);
+    free(jobs[p].code);
+  }
+  return linked;
+}
+
+// Stop compiling after an error: exit, or abandon the request when serving
+void fail()
+{
+  if (speculating) // Lexing a chunk whose start state may be wrong
+    longjmp(parallel_abort, 1);
+  remove_partial_output(); // A lexical error can come after -s has written some procedures
+  if (server_mode)
+    longjmp(compile_abort, 1);
+  exit(1);
+}
+
+// Apply the compiler options in argv starting at argi, returning the index of the first argument
+// that is not a known option
+int parse_options(int argc, char *argv[], int argi)
+{
+  while (argi < argc && argv[argi][0] == '-')
+  {
+    if (strcmp(argv[argi], "-x") == 0)
+      extended_isa = 1;
+    else if (strcmp(argv[argi], "-s") == 0)
+      streaming = 1;
+    else if (strcmp(argv[argi], "-g") == 0)
+      debug_info = 1;
+    else if (strcmp(argv[argi], "-a") == 0)
+      analyze = 1;
+    else if (strcmp(argv[argi], "-p") == 0)
+      pipelined = 1;
+    else if (strcmp(argv[argi], "-O") == 0)
+      optimize_level = 1;
+    else if (strncmp(argv[argi], "-O", 2) == 0 && isdigit(argv[argi][2]) && argv[argi][3] == '\0')
+      optimize_level = argv[argi][2] - '0';
+    else if (strcmp(argv[argi], "-c") == 0)
+      object_output = 1;
+    else if (strcmp(argv[argi], "-j") == 0)
+      parallel_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    else if (strncmp(argv[argi], "-j", 2) == 0 && atoi(argv[argi] + 2) > 0)
+      parallel_threads = atoi(argv[argi] + 2);
+    else
+      break;
+    argi++;
+  }
+  return argi;
+}
+
+// Put the global compiler state back the way a fresh process starts
+void reset_compiler()
+{
+  source_pos = source_len = 0;
+  window_offset = 0;
+  source_line = 1;
+  line_start = 0;
+  lexeme_line = lexeme_column = 0;
+  reset_parser();
+  extended_isa = optimize_level = streaming = debug_info = parallel_threads = object_output = analyze = pipelined = 0;
+  num_externals = 0;
+  elf_file = map_file = NULL;
+  num_tracked = num_modified = 0;
+}
+
+// Empty a reused worker file, returning it ready to be written
+FILE *reset_file(FILE *f)
+{
+  fflush(f);
+  if (ftruncate(fileno(f), 0) != 0)
+    return f;
+  rewind(f);
+  return f;
+}
+
+// Compile one source buffer with the given space-separated options, writing the listing, code and
+// map to the worker's files. Return the exit status the command-line compiler would have had.
+int compile_request(char *options, char *source, long length)
+{
+  char *argv[64];
+  int argc = 0;
+  for (char *option = strtok(options, " \t"); option != NULL && argc < 64; option = strtok(NULL, " \t"))
+    argv[argc++] = option;
+
+  reset_compiler();
+  reset_file(output_file);
+  reset_file(request_code);
+  reset_file(request_map);
+
+  int argi = parse_options(argc, argv, 0);
+  if (argi < argc)
   {
-    do
-    {
-      get_next_token();
-      statement();                                       // Parse statement
-    } while (atoi(current_token.value) == semicolonsym); // Continue parsing statements if next token is a semicolon
-    if (atoi(current_token.value) != endsym)             // Check if next token is an end
-    {
-      error(10); // Error if it isn't
-    }
-    get_next_token();
+    fprintf(output_file, "Unknown option %s\n", argv[argi]);
+    return 1;
   }
-  else if (atoi(current_token.value) == ifsym) // Check if current token is an if
+  if (object_output && streaming)
   {
-    get_next_token();
-    condition(); // Parse condition
-    int jx = cx;
-    emit(8, 0, 0);                            // Emit JPC instruction
-    if (atoi(current_token.value) != thensym) // Check if next token is a then
-    {
-      error(11); // Error if it isn't
-    }
-    get_next_token();
-    statement();         // Parse statement
-    code[jx].m = cx * 3; // Set JPC instruction's M to current code index
+    fprintf(output_file, "Error: -c cannot be combined with -s\n");
+    return 1;
   }
-  else if (atoi(current_token.value) == whilesym) // Check if current token is a while
+  if (pipelined && parallel_threads > 0)
   {
-    get_next_token();
-    int lx = cx;
-    condition();                            // Parse condition
-    if (atoi(current_token.value) != dosym) // Check if next token is a do
-    {
-      error(12); // Error if it isn't
-    }
-    get_next_token();
-    int jx = cx;         // Save current code index to jump to
-    emit(8, 0, 0);       // Emit JPC instruction
-    statement();         // Parse statement
-    emit(7, 0, lx * 3);  // Emit JMP instruction
-    code[jx].m = cx * 3; // Set JPC instruction's M to current code index
+    fprintf(output_file, "Error: -p cannot be combined with -j\n");
+    return 1;
   }
-  else if (atoi(current_token.value) == readsym) // Check if current token is a read
+
+  input_file = fmemopen(source, length, "r");
+  if (input_file == NULL)
   {
-    get_next_token();
-    if (atoi(current_token.value) != identsym) // Check if current token is an identifier
-    {
-      error(2); // Error if it isn't
-    }
-    int sx = check_symbol_table(current_token.lexeme, 0); // Check if identifier is in symbol table
-    if (sx == -1)
-    {
-      error(7); // Error if it isn't
-    }
-    if (symbol_table[sx].kind != 2) // Check if identifier is a variable
-    {
-      error(8); // Error if it isn't
-    }
-    get_next_token();
-    emit(9, 0, 2);      // Emit SIO instruction
-    emit(4, level, sx); // Emit STO instruction
+    fprintf(output_file, "Error: Could not open input file\n");
+    return 1;
   }
-  else if (atoi(current_token.value) == writesym) // Check if current token is a write
+  token_list = create_list();
+  if (streaming)
+    elf_file = request_code;
+  if (debug_info)
+    map_file = request_map;
+
+  int status = 1;
+  if (setjmp(compile_abort) == 0)
   {
-    get_next_token();
-    expression();  // Parse expression
-    emit(9, 0, 1); // Emit SIO instruction
+    if (pipelined)
+      start_pipeline();
+    else if (!streaming || parallel_threads > 0)
+      lex_input();
+    program();
+    status = 0;
   }
+
+  destroy_list(token_list);
+  fclose(input_file);
+  return status;
 }
 
-// Parse condition
-void condition()
+// Read one request: a line of options, a line with the source length, then the source bytes.
+// The buffers are grown as needed and kept for the next request. Return 0 at end of input.
+int read_request(FILE *in, char **options, size_t *options_size, char **source, long *capacity, long *length)
 {
-  if (atoi(current_token.value) == oddsym) // Check if current token is odd
+  char header[32];
+  ssize_t n = getline(options, options_size, in);
+  if (n <= 0 || fgets(header, sizeof(header), in) == NULL)
+    return 0;
+  if ((*options)[n - 1] == '\n')
+    (*options)[n - 1] = '\0';
+
+  *length = atol(header);
+  if (*length < 0)
+    return 0;
+  if (*length + 1 > *capacity)
   {
-    get_next_token();
-    expression();   // Parse expression
-    emit(2, 0, 11); // Emit ODD instruction
+    *capacity = *length + 1;
+    *source = realloc(*source, *capacity);
   }
-  else
+  if ((long)fread(*source, 1, *length, in) != *length)
+    return 0;
+  (*source)[*length] = '\0';
+  return 1;
+}
+
+// Append the contents of a worker file to the response
+void copy_file(FILE *from, FILE *to)
+{
+  char chunk[8192];
+  size_t n;
+  rewind(from);
+  while ((n = fread(chunk, 1, sizeof(chunk), from)) > 0)
+    fwrite(chunk, 1, n, to);
+}
+
+// Send the result of a request: a line with the exit status and the sizes of the listing, code
+// and map, followed by their contents
+void write_response(FILE *out, int status)
+{
+  FILE *files[3] = {output_file, request_code, request_map};
+  long size[3];
+  for (int i = 0; i < 3; i++)
   {
-    expression();                      // Parse expression
-    switch (atoi(current_token.value)) // Check if current token is a comparison operator
-    {
-    case eqsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 5); // Emit EQL instruction
-      break;
-    case neqsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 6); // Emit NEQ instruction
-      break;
-    case lessym:
-      get_next_token();
-      expression();
-      emit(2, 0, 7); // Emit LSS instruction
-      break;
-    case leqsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 8); // Emit LEQ instruction
-      break;
-    case gtrsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 9); // Emit GTR instruction
-      break;
-    case geqsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 10); // Emit GEQ instruction
-      break;
-    default:
-      error(13); // Error if it isn't
-      break;
-    }
+    fflush(files[i]);
+    fseek(files[i], 0, SEEK_END);
+    size[i] = ftell(files[i]);
   }
+  if (status != 0)
+    size[1] = size[2] = 0; // The command-line compiler keeps no code after an error
+
+  fprintf(out, "%d %ld %ld %ld\n", status, size[0], size[1], size[2]);
+  for (int i = 0; i < 3; i++)
+    if (size[i] > 0)
+      copy_file(files[i], out);
+  fflush(out);
 }
 
-// Parse expression
-void expression()
+// Answer requests from a client until it closes the connection
+void serve_connection(FILE *in, FILE *out)
 {
-  term(); // Parse term
-  // Check if current token is a plus or minus
-  while (atoi(current_token.value) == plussym || atoi(current_token.value) == minussym)
+  static char *options = NULL, *source = NULL; // Reused by every request this worker serves
+  static size_t options_size = 0;
+  static long capacity = 0;
+  long length;
+
+  while (read_request(in, &options, &options_size, &source, &capacity, &length))
   {
-    if (atoi(current_token.value) == plussym) // Check if current token is a plus
-    {
-      get_next_token();
-      term();
-      emit(2, 0, 1); // Emit ADD instruction
-    }
-    else
-    {
-      get_next_token();
-      term();
-      emit(2, 0, 2); // Emit SUB instruction
-    }
+    int status = compile_request(options, source, length);
+    write_response(out, status);
   }
 }
 
-// Parse term
-void term()
+// Accept connections on the shared listening socket until the server shuts down
+void run_worker(int listen_fd)
 {
-  factor(); // Parse factor
-  while (atoi(current_token.value) == multsym || atoi(current_token.value) == slashsym)
+  signal(SIGPIPE, SIG_IGN); // A client that disconnects early only ends its own connection
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  output_file = tmpfile();
+  request_code = tmpfile();
+  request_map = tmpfile();
+  if (output_file == NULL || request_code == NULL || request_map == NULL)
+    exit(1);
+
+  while (1)
   {
-    if (atoi(current_token.value) == multsym) // Check if current token is a multiply
-    {
-      get_next_token();
-      factor();      // Parse factor
-      emit(2, 0, 3); // Emit MUL
-    }
-    else
-    {
-      get_next_token();
-      factor();      // Parse factor
-      emit(2, 0, 4); // Emit DIV
-    }
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    if (in != NULL && out != NULL)
+      serve_connection(in, out);
+    if (in != NULL)
+      fclose(in);
+    if (out != NULL)
+      fclose(out);
   }
 }
 
-// Parse factor
-void factor()
+void stop_server(int sig)
 {
-  if (atoi(current_token.value) == identsym) // Check if current token is an identifier
+  (void)sig;
+  server_stopping = 1;
+}
+
+// Serve compile requests over a Unix domain socket with a pool of worker processes, or from
+// standard input to standard output when the path is "-"
+int run_server(int argc, char *argv[])
+{
+  if (argc < 1 || argc > 2)
   {
-    int sx = check_symbol_table(current_token.lexeme, 0); // Check if identifier is in symbol table
-    if (sx == -1)
-    {
-      error(7); // Error if it isn't
-    }
-    if (symbol_table[sx].kind == 1) // Check if identifier is a constant
-    {
-      emit(1, 0, symbol_table[sx].val); // Emit LIT instruction
-    }
-    else
-    {
-      emit(3, level - symbol_table[sx].level, symbol_table[sx].addr); // Emit LOD instruction
-    }
-    get_next_token();
+    printf("Usage: --server <socket path | -> [workers]\n");
+    return 1;
   }
-  else if (atoi(current_token.value) == numbersym) // Check if current token is a number
+  server_mode = 1;
+  init_lexer_simd();
+
+  if (strcmp(argv[0], "-") == 0)
   {
-    emit(1, 0, atoi(current_token.lexeme)); // Emit LIT instruction
-    get_next_token();
+    output_file = tmpfile();
+    request_code = tmpfile();
+    request_map = tmpfile();
+    if (output_file == NULL || request_code == NULL || request_map == NULL)
+      return 1;
+    serve_connection(stdin, stdout);
+    return 0;
   }
-  else if (atoi(current_token.value) == lparentsym) // Check if current token is a left parenthesis
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(argv[0]) >= sizeof(address.sun_path))
   {
-    get_next_token();
-    expression();                                // Parse expression
-    if (atoi(current_token.value) != rparentsym) // Check if currenet token is right parenthesis
-    {
-      error(14); // Error if it isn't
-    }
-    get_next_token();
+    printf("Error: Socket path %s is too long\n", argv[0]);
+    return 1;
   }
-  else
+  strcpy(address.sun_path, argv[0]);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(argv[0]);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, 128) != 0)
   {
-    error(15); // Error if current token is none of the above
+    printf("Error: Could not listen on %s\n", argv[0]);
+    return 1;
   }
-}
 
-// Print symbol table
-void print_symbol_table()
-{
-  print_both("\nSymbol Table:\n");
-  print_both("%10s | %10s | %10s | %10s | %10s | %10s\n", "Kind", "Name", "Value", "Level", "Address", "Mark", "\n");
-  print_both("    -----------------------------------------------------------------------\n");
+  int workers = argc == 2 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers < 1)
+    workers = 1;
+  pid_t *pids = malloc(sizeof(pid_t) * workers);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_server;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
 
-  for (int i = 0; i < MAX_SYMBOL_TABLE_SIZE; i++)
+  for (int i = 0; i < workers; i++)
+    if ((pids[i] = fork()) == 0)
+      run_worker(listen_fd);
+
+  while (!server_stopping)
   {
-    if (symbol_table[i].kind == 0)
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0)
       continue;
-
-    symbol_table[i].mark = 1;
-    if (symbol_table[i].kind == 1)
-      print_both("%10d | %10s | %10d | %10s | %10s | %10d\n", symbol_table[i].kind, symbol_table[i].name, symbol_table[i].val, "-", "-", symbol_table[i].mark);
-    else
-      print_both("%10d | %10s | %10d | %10d | %10d | %10d\n", symbol_table[i].kind, symbol_table[i].name, symbol_table[i].val, symbol_table[i].level, symbol_table[i].addr, symbol_table[i].mark);
+    for (int i = 0; i < workers; i++)
+      if (pids[i] == pid && !server_stopping) // Replace a worker that died
+        if ((pids[i] = fork()) == 0)
+          run_worker(listen_fd);
   }
+
+  for (int i = 0; i < workers; i++)
+    kill(pids[i], SIGTERM);
+  while (wait(NULL) > 0)
+    ;
+  unlink(argv[0]);
+  free(pids);
+  return 0;
 }
 
-// Print assmebly code
-void print_instructions()
+// Read a relocatable object written by write_object(), returning 0 if it is malformed
+int read_object(FILE *f, object_module *module)
 {
+  char magic[16];
+  if (fscanf(f, "%15s object frame %d externals %d", magic, &module->frame, &module->num_externals) != 3 ||
+      strcmp(magic, "PL/0") != 0 || module->num_externals < 0)
+    return 0;
+  module->externals = malloc((module->num_externals + 1) * sizeof(*module->externals));
+  module->external_addr = malloc((module->num_externals + 1) * sizeof(int));
+  for (int k = 0; k < module->num_externals; k++)
+    if (fscanf(f, "%11s", module->externals[k]) != 1)
+      return 0;
 
-  print_both("Assembly Code:\n");
-  print_both("%10s %10s %10s %10s\n", "Line", "OP", "L", "M");
-  for (int i = 0; i < cx; i++)
+  if (fscanf(f, " exports %d", &module->num_exports) != 1 || module->num_exports < 0)
+    return 0;
+  module->exports = malloc((module->num_exports + 1) * sizeof(*module->exports));
+  module->export_offset = malloc((module->num_exports + 1) * sizeof(int));
+  for (int k = 0; k < module->num_exports; k++)
+    if (fscanf(f, "%11s %d", module->exports[k], &module->export_offset[k]) != 2)
+      return 0;
+
+  if (fscanf(f, " procedures %d", &module->num_procedure) != 1 || module->num_procedure < 0)
+    return 0;
+  module->code = malloc((module->num_procedure + 1) * sizeof(instruction));
+  module->reloc = malloc(module->num_procedure + 1);
+  for (int i = 0, n = module->num_procedure, section = 0; section < 2; section++)
   {
-    char name[4];
-    get_op_name(code[i].op, name);
-    print_both("%10d %10s %10d %10d\n", i, name, code[i].l, code[i].m);
+    if (section == 1)
+    {
+      if (fscanf(f, " main %d", &module->num_main) != 1 || module->num_main < 0)
+        return 0;
+      n += module->num_main;
+      module->code = realloc(module->code, (n + 1) * sizeof(instruction));
+      module->reloc = realloc(module->reloc, n + 1);
+    }
+    for (; i < n; i++)
+    {
+      instruction *ir = &module->code[i];
+      if (fscanf(f, "%d %d %d %c", &ir->op, &ir->l, &ir->m, &module->reloc[i]) != 4)
+        return 0;
+      if ((module->reloc[i] == 'x' && (ir->m < 0 || ir->m >= module->num_externals)) ||
+          (module->reloc[i] == 'p' && (ir->m < 0 || ir->m >= module->num_procedure)) ||
+          (module->reloc[i] == 'b' && ir->m < 0))
+        return 0;
+    }
   }
+  return 1;
 }
 
-// Get op name from op code
-void get_op_name(int op, char *name)
+// Link relocatable objects into a code file. The procedures of every module come first, then one
+// INC for the shared main frame and the main statements in the order the objects are given, so
+// each module's main statement runs before the next one's. A jump past the end of a module's main
+// statement falls into the next one, or the final HALT.
+int link_objects(int argc, char *argv[])
 {
-  switch (op)
+  if (argc < 2)
   {
-  case 1:
-    strcpy(name, "LIT");
-    break;
-  case 2:
-    strcpy(name, "OPR");
-    break;
-  case 3:
-    strcpy(name, "LOD");
-    break;
-  case 4:
-    strcpy(name, "STO");
-    break;
-  case 5:
-    strcpy(name, "CAL");
-    break;
-  case 6:
-    strcpy(name, "INC");
-    break;
-  case 7:
-    strcpy(name, "JMP");
-    break;
-  case 8:
-    strcpy(name, "JPC");
-    break;
-  case 9:
-    strcpy(name, "SYS");
-    break;
+    printf("Usage: --link <code file> <object files>\n");
+    return 1;
   }
-}
 
-void print_elf_file()
-{
-  FILE *elf_file = fopen("elf.txt", "w");
-  for (int i = 0; i < cx; i++)
+  int num_modules = argc - 1;
+  object_module *modules = calloc(num_modules, sizeof(object_module));
+  int *procedure_base = malloc(num_modules * sizeof(int)); // Address index of each procedure section
+  int *main_base = malloc(num_modules * sizeof(int));      // Address index of each main section
+  int *data_base = malloc(num_modules * sizeof(int));      // Offset of each module's main frame slots
+  int total_procedure = 0, total_main = 0, frame = 4;
+  for (int k = 0; k < num_modules; k++)
+  {
+    FILE *f = fopen(argv[k + 1], "r");
+    if (f == NULL)
+    {
+      printf("Error: Could not open object file %s\n", argv[k + 1]);
+      return 1;
+    }
+    int ok = read_object(f, &modules[k]);
+    fclose(f);
+    if (!ok || modules[k].frame < 4)
+    {
+      printf("Error: %s is not a PL/0 object file\n", argv[k + 1]);
+      return 1;
+    }
+    for (int i = 0; i < modules[k].num_main; i++)
+      if (modules[k].reloc[modules[k].num_procedure + i] == 'b' &&
+          modules[k].code[modules[k].num_procedure + i].m > modules[k].num_main)
+      {
+        printf("Error: %s is not a PL/0 object file\n", argv[k + 1]);
+        return 1;
+      }
+
+    procedure_base[k] = 1 + total_procedure; // After the JMP to the main statements
+    total_procedure += modules[k].num_procedure;
+    data_base[k] = frame - 4; // Slots 0-2 hold the frame links and the last slot is spare
+    frame += modules[k].frame - 4;
+  }
+  int main_start = 1 + total_procedure; // Main frame INC
+  for (int k = 0, next = main_start + 1; k < num_modules; k++)
   {
-    fprintf(elf_file, "%d %d %d\n", code[i].op, code[i].l, code[i].m);
+    main_base[k] = next;
+    next += modules[k].num_main;
+    total_main += modules[k].num_main;
   }
 
-  fclose(elf_file);
+  // Resolve each external procedure to the module that exports it
+  for (int k = 0; k < num_modules; k++)
+    for (int e = 0; e < modules[k].num_exports; e++)
+      for (int j = 0; j <= k; j++)
+        for (int d = 0; d < modules[j].num_exports; d++)
+          if ((j < k || d < e) && strcmp(modules[j].exports[d], modules[k].exports[e]) == 0)
+          {
+            printf("Error: Procedure %s is defined by %s and %s\n", modules[k].exports[e], argv[j + 1], argv[k + 1]);
+            return 1;
+          }
+  int status = 0;
+  for (int k = 0; k < num_modules; k++)
+    for (int x = 0; x < modules[k].num_externals; x++)
+    {
+      modules[k].external_addr[x] = -1;
+      for (int j = 0; j < num_modules; j++)
+        for (int e = 0; e < modules[j].num_exports; e++)
+          if (strcmp(modules[j].exports[e], modules[k].externals[x]) == 0)
+            modules[k].external_addr[x] = procedure_base[j] + modules[j].export_offset[e];
+      if (modules[k].external_addr[x] == -1)
+      {
+        printf("Error: Procedure %s called by %s is not defined\n", modules[k].externals[x], argv[k + 1]);
+        status = 1;
+      }
+    }
+  if (status != 0)
+    return status;
 
-  for (int i = 0; i < cx; i++)
+  FILE *code_file = fopen(argv[0], "w");
+  if (code_file == NULL)
   {
-    print_both("%d %d %d\n", code[i].op, code[i].l, code[i].m);
+    printf("Error: Could not open code file %s\n", argv[0]);
+    return 1;
   }
+  fprintf(code_file, "%d %d %d\n", 7, 0, main_start * 3); // JMP to the main frame INC
+  for (int section = 0; section < 2; section++)
+  {
+    if (section == 1)
+      fprintf(code_file, "%d %d %d\n", 6, 0, frame); // INC for the shared main frame
+    for (int k = 0; k < num_modules; k++)
+    {
+      object_module *module = &modules[k];
+      int from = section == 0 ? 0 : module->num_procedure;
+      int to = section == 0 ? module->num_procedure : module->num_procedure + module->num_main;
+      for (int i = from; i < to; i++)
+      {
+        instruction ir = module->code[i];
+        switch (module->reloc[i])
+        {
+        case 'p':
+          ir.m = (procedure_base[k] + ir.m) * 3;
+          break;
+        case 'b':
+          ir.m = (main_base[k] + ir.m) * 3;
+          break;
+        case 'x':
+          ir.m = module->external_addr[ir.m] * 3;
+          break;
+        case 'd':
+          ir.m += data_base[k];
+          break;
+        }
+        fprintf(code_file, "%d %d %d\n", ir.op, ir.l, ir.m);
+      }
+    }
+  }
+  fprintf(code_file, "%d %d %d\n", 9, 0, 3); // HALT
+  fclose(code_file);
+  printf("Linked %d objects into %s: %d instructions\n", num_modules, argv[0], main_start + 2 + total_main);
+
+  for (int k = 0; k < num_modules; k++)
+  {
+    free(modules[k].externals);
+    free(modules[k].external_addr);
+    free(modules[k].exports);
+    free(modules[k].export_offset);
+    free(modules[k].code);
+    free(modules[k].reloc);
+  }
+  free(modules);
+  free(procedure_base);
+  free(main_base);
+  free(data_base);
+  return 0;
 }
@@ -0,0 +1,60 @@
+#!/bin/bash
+# Lexer benchmark. Generates a 64 MB program of long whitespace runs, block and line comments,
+# identifiers and numbers, then times each compiler's --lex on it, which lexes without parsing or
+# writing a listing. Each compiler runs RUNS times (default 5) and its fastest run is shown. Every
+# compiler must find the same number of tokens.
+#
+#   tests/bench_lexer.sh <compiler>...
+
+if [ $# -eq 0 ]
+then
+  echo "Usage: $0 <compiler>..."
+  exit 2
+fi
+
+runs=${RUNS:-5}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Each group of lines is about 260 bytes: an indented statement, a block comment, a run of blank
+# lines and a line comment
+awk 'BEGIN {
+  print "var total, value;"
+  print "begin"
+  print "  total := 0"
+  for (i = 0; i < 256000; i++)
+  {
+    printf "%48s; value := %5d * identifier%d + total\n", "", i % 100000, i % 10
+    printf "  /* block comment %6d: the lexer skips to the closing star and slash in one scan */\n", i
+    printf "\t\t\n\n    \t\n"
+    printf "%32s// line comment %6d, skipped to the newline\n", "", i
+  }
+  print "end."
+}' > "$work/input.txt"
+
+TIMEFORMAT=%R
+tokens=""
+echo "Lexing $(($(wc -c < "$work/input.txt") / 1048576)) MB, fastest of $runs runs:"
+for compiler in "$@"
+do
+  result=$("$compiler" --lex "$work/input.txt")
+  if [ $? -ne 0 ]
+  then
+    echo "$compiler: --lex failed"
+    exit 1
+  fi
+  if [ -n "$tokens" ] && [ "${result%% *}" != "$tokens" ]
+  then
+    echo "$compiler: found ${result%% *} tokens instead of $tokens"
+    exit 1
+  fi
+  tokens=${result%% *}
+
+  best=""
+  for ((run = 0; run < runs; run++))
+  do
+    seconds=$( { time "$compiler" --lex "$work/input.txt" > /dev/null; } 2>&1 )
+    best=$(awk -v a="$seconds" -v b="$best" 'BEGIN { print (b == "" || a < b) ? a : b }')
+  done
+  printf "  %-16s %6ss  (%s)\n" "$compiler" "$best" "${result#*, }"
+done
@@ -0,0 +1,116 @@
+#!/bin/bash
+# Generated code regression suite. Compiles each program of the corpus (the .txt programs at the top
+# of the tree and tests/codegen/programs) at each optimization level, runs it on the VM, and records
+# per level the compile status, the program's output, the instructions emitted (code size) and
+# executed, and both counts per opcode. The results are compared with the baselines checked in
+# under tests/codegen/baselines.
+#
+#   tests/check_codegen.sh [--update] <compiler> <vm>
+#
+# Every difference from a baseline is shown. The check fails if a program's code size or executed
+# instruction count at some level grows by more than CODEGEN_THRESHOLD percent (default 2), if its
+# compile status or output changes, or if it has no baseline. --update rewrites the baselines from
+# the current compiler instead.
+
+update=0
+if [ "$1" = "--update" ]
+then
+  update=1
+  shift
+fi
+if [ $# -ne 2 ]
+then
+  echo "Usage: $0 [--update] <compiler> <vm>"
+  exit 2
+fi
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+compiler=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+vm=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+threshold=${CODEGEN_THRESHOLD:-2}
+baselines=$root/tests/codegen/baselines
+input=$root/tests/codegen/input.txt
+levels="O0: O0x:-x O1:-O O1x:-O_-x O2:-O2 O2x:-O2_-x" # Name and compiler options, _ for a space
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Print the result lines of one program at one level
+measure()
+{
+  local name=$1 options=$2 program=$3
+  rm -f "$work"/elf.txt
+  (cd "$work" && "$compiler" -a $options "$program" listing.txt > /dev/null 2>&1)
+  local status=$?
+  echo "$name status $status"
+  [ $status -eq 0 ] || return
+
+  echo "$name size $(wc -l < "$work"/elf.txt)"
+  awk -v level="$name" '/^  OP Name  Emitted$/ { counting = 1; next }
+                        counting && NF == 3 { print level " emitted " $1 " " $3 }
+                        counting && NF != 3 { counting = 0 }' "$work"/listing.txt
+
+  (cd "$work" && timeout 60 "$vm" -c -m elf.txt < "$input" > output.txt 2> counts.txt)
+  echo "$name exit $?"
+  echo "$name output $(cksum < "$work"/output.txt | tr ' ' '-')"
+  awk -v level="$name" '/^Instructions executed:/ { print level " executed " $3 }
+                        /^Opcode Mix:/ { counting = 1; next }
+                        counting && $1 ~ /^[0-9]+$/ { print level " ran " $1 " " $2 }' "$work"/counts.txt
+}
+
+failed=0
+for program in "$root"/*.txt "$root"/tests/codegen/programs/*.txt
+do
+  case $(basename "$program") in
+  expected_*) continue ;; # Expected compiler output, not a program
+  esac
+  name=$(basename "$program" .txt)
+  for level in $levels
+  do
+    options=${level#*:}
+    measure "${level%%:*}" "${options//_/ }" "$program"
+  done > "$work/$name.counts"
+
+  if [ $update -eq 1 ]
+  then
+    cp "$work/$name.counts" "$baselines/$name.counts"
+    continue
+  fi
+  if [ ! -f "$baselines/$name.counts" ]
+  then
+    echo "$name: no baseline, run make update-codegen-baselines"
+    failed=1
+    continue
+  fi
+  if ! cmp -s "$baselines/$name.counts" "$work/$name.counts"
+  then
+    echo "$name:"
+    diff "$baselines/$name.counts" "$work/$name.counts" | sed 's/^/  /'
+  fi
+
+  # Sizes and executed counts may shrink, or grow within the threshold; anything else must match
+  awk -v name="$name" -v threshold="$threshold" '
+    NR == FNR { if ($2 != "emitted" && $2 != "ran") base[$1 " " $2] = $3; next }
+    $2 == "emitted" || $2 == "ran" { next }
+    !(($1 " " $2) in base) { printf "%s %s: %s %s is new\n", name, $1, $2, $3; bad = 1; next }
+    ($2 == "size" || $2 == "executed") && $3 > base[$1 " " $2] * (1 + threshold / 100) {
+      printf "%s %s: %s grew from %d to %d, more than %s%%\n", name, $1, $2, base[$1 " " $2], $3, threshold
+      bad = 1
+    }
+    $2 != "size" && $2 != "executed" && $3 != base[$1 " " $2] {
+      printf "%s %s: %s changed from %s to %s\n", name, $1, $2, base[$1 " " $2], $3
+      bad = 1
+    }
+    END { exit bad }' "$baselines/$name.counts" "$work/$name.counts" || failed=1
+done
+
+if [ $update -eq 1 ]
+then
+  echo "Baselines updated"
+elif [ $failed -eq 1 ]
+then
+  echo "check-codegen: FAILED"
+  exit 1
+else
+  echo "check-codegen: passed"
+fi
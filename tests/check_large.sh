@@ -0,0 +1,143 @@
+#!/bin/bash
+# Large program suite. Generates programs with more procedures than the compiler's tables start
+# with, compiles each in the modes listed with it, runs the result on the VM and compares the
+# output with what the generator computed. Modes that must produce the same code as the first
+# mode in their list are compared with it byte for byte.
+#
+#   tests/check_large.sh <compiler> <vm>
+
+if [ $# -ne 2 ]
+then
+  echo "Usage: $0 <compiler> <vm>"
+  exit 2
+fi
+
+compiler=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+vm=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Write a program of groups * size procedures, each with a nested procedure, called through one
+# procedure per group so main stays short, to $work/name.txt and its output to $work/name.expected.
+# Each procedure is followed by a block comment of padding lines.
+generate_procedures()
+{
+  local name=$1 groups=$2 size=$3 padding=$4
+  awk -v groups="$groups" -v size="$size" -v padding="$padding" -v expected="$work/$name.expected" 'BEGIN {
+    print "var x;"
+    for (g = 0; g < groups; g++)
+    {
+      for (k = 0; k < size; k++)
+      {
+        i = g * size + k + 1
+        print "procedure p" i ";"
+        print "  var a" i ";"
+        print "  procedure q" i ";"
+        print "    begin x := x + " i " end;"
+        print "  begin a" i " := " i "; call q" i "; x := x - a" i " / 2 end;"
+        for (j = 0; j < padding; j++)
+          printf "%s padding line %4d of procedure p%-4d, long enough to make the input cross the chunk size %s\n",
+                 j ? "  " : "/*", j, i, j == padding - 1 ? "*/" : "  "
+      }
+      printf "procedure g%d;\n  begin", g
+      for (k = 0; k < size; k++)
+        printf "%s call p%d", k ? ";" : "", g * size + k + 1
+      print " end;"
+    }
+    printf "begin\n  x := 0"
+    for (g = 0; g < groups; g++)
+    {
+      printf ";\n  call g%d;\n  write x", g
+      for (k = 0; k < size; k++)
+      {
+        i = g * size + k + 1
+        x += i - int(i / 2)
+      }
+      print x > expected
+    }
+    print "\nend."
+  }' > "$work/$name.txt"
+}
+
+failed=0
+
+# Compile and run program name with each mode, the options separated by _. If limit is set, the
+# compiler runs with at most limit KiB of memory.
+check()
+{
+  local name=$1 first="" first_options=""
+  shift
+  for mode in "$@"
+  do
+    local options=${mode//_/ } dir="$work/$name-$mode"
+    mkdir -p "$dir"
+    (cd "$dir" && ulimit -v "${limit:-unlimited}" && "$compiler" $options "$work/$name.txt" listing.txt > /dev/null 2>&1)
+    local status=$?
+    if [ $status -ne 0 ]
+    then
+      echo "$name $options: compiler exited with $status"
+      failed=1
+      continue
+    fi
+    (cd "$dir" && "$vm" elf.txt > output.txt 2>&1)
+    if ! cmp -s "$work/$name.expected" "$dir/output.txt"
+    then
+      echo "$name $options: wrong output"
+      failed=1
+    fi
+    if [ -z "$first" ]
+    then
+      first=$dir
+      first_options=${options:-no options}
+    elif ! cmp -s "$first/elf.txt" "$dir/elf.txt" || ! cmp -s "$first/listing.txt" "$dir/listing.txt"
+    then
+      echo "$name $options: code or listing differs from $first_options"
+      failed=1
+    fi
+  done
+}
+
+# The streaming compiler writes out each procedure as it finishes, so it takes any number of them
+generate_procedures streamed 20 40 0
+check streamed -s -s_-j4 -s_-p
+check streamed -s_-O -s_-O_-j4
+check streamed -s_-O2_-x -s_-O2_-x_-j4
+check streamed -s_-g
+
+# It keeps nothing for the procedures it has written out, so its memory does not grow with their
+# number. Holding every procedure takes over twice the limit.
+generate_procedures wide 100 50 0
+limit=16384 check wide -s -s_-g
+
+# Otherwise the code array and the optimizer's tables grow to hold the whole program
+generate_procedures held 20 40 0
+check held "" -j4 -p
+check held -O -O_-j4
+check held -O2_-x -O2_-x_-j4
+check held -a -a_-j4
+
+# With -j, an input of two lexer chunks or more is also lexed on parallel threads, and the block
+# comments make chunks start inside a comment
+generate_procedures padded 20 40 30
+check padded "" -j4 -j2
+check padded -O2_-x -O2_-x_-j4
+check padded -s -s_-j4
+
+# A 0xff byte ends the input as the end of the file does, so what follows is never lexed, with -p
+# too. It can come right after a token or after whitespace.
+printf 'var x;\nbegin x := 7; write x end.\xff*/ @' > "$work/marked.txt"
+echo 7 > "$work/marked.expected"
+check marked "" -j4 -p
+check marked -s -s_-p
+generate_procedures truncated 2 40 0
+printf '\xff*/ @' >> "$work/truncated.txt"
+check truncated "" -j4 -p
+check truncated -s -s_-p
+
+if [ $failed -eq 1 ]
+then
+  echo "check-large: FAILED"
+  exit 1
+fi
+echo "check-large: passed"
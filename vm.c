@@ -0,0 +1,1571 @@
+/*
+    COP 3402 Systems Software
+    PM/0 Virtual Machine
+    Authored by Caleb Rivera and Matthew Labrada
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include "vm.h"
+
+#define MAX_STACK_HEIGHT 2000
+#define MAX_NAME_LENGTH 11
+#define HOT_LINE_PERCENT 5 // Lines executing at least this share of instructions are marked hot
+#define TIME_SLICE 100000  // Instructions a batch execution runs before another gets its thread
+
+// State of the checking interpreter, used for profiling
+instruction *code = NULL;          // Loaded program
+int code_length = 0;               // Number of loaded instructions
+int *stack = NULL;                 // Runtime stack
+int stack_size = MAX_STACK_HEIGHT; // Cells allocated for the runtime stack
+int pc = 0;                        // Program counter (instruction index)
+int bp = 0;                        // Base pointer
+int sp = -1;                       // Stack pointer (index of top element)
+long long executed = 0;            // Number of instructions dispatched
+int count_instructions = 0;        // Report dispatch count when set (-c)
+int opcode_mix = 0;                // Report executions per opcode when set (-m)
+vm_execution console;              // Buffered standard input and output of the checking interpreter
+
+// Profiling state (-p)
+int profiling = 0;                               // Collect an execution profile when set
+int *code_line = NULL;                           // Source line of each instruction, from the map file
+int *code_proc = NULL;                           // Procedure of each instruction, from the map file
+long long *instruction_count = NULL;             // Executions of each instruction
+char (*proc_names)[MAX_NAME_LENGTH + 1] = NULL; // Procedure names, main first
+int num_procs = 0;                               // Number of procedures in the map file
+int proc_capacity = 0;                           // Entries in each table indexed by procedure
+long long *proc_calls = NULL;                    // Activations of each procedure
+long long *proc_inclusive = NULL;                // Instructions executed while each procedure was active
+int *proc_active = NULL;                         // Activations of each procedure currently on the stack
+
+typedef struct
+{
+  int proc;             // Procedure of this activation
+  int node;             // Call-stack trie node of this activation
+  long long entry;      // Instruction count at entry if outermost activation of proc, else -1
+} frame;
+
+frame *frames = NULL;  // Shadow call stack
+int num_frames = 0;
+int frames_capacity = 0;
+
+typedef struct
+{
+  int proc;         // Procedure at this point of the call stack
+  int parent;       // Caller's node, -1 for the root
+  int first_child;  // First callee node
+  int next_sibling; // Next node with the same parent
+  long long count;  // Instructions executed with exactly this call stack
+} stack_node;
+
+stack_node *nodes = NULL; // Trie of distinct call stacks, for the collapsed-stack output
+int num_nodes = 0;
+int nodes_capacity = 0;
+
+// Function prototypes
+int run_batch(int threads, int runs, long long budget, int num_files, char *file_names[]);
+char *read_text(FILE *f);
+int base(int l);
+void push(int value);
+int pop();
+void run();
+void vm_error(const char *message);
+vm_status fail_execution(vm_execution *execution, int index, long long count, const char *message);
+int format_int(char *dest, int value);
+int write_output(vm_execution *execution, int value);
+int fill_input(vm_execution *execution);
+int read_input(vm_execution *execution, int *value);
+int *acquire_stack(vm_program *program);
+void release_stack(vm_execution *execution);
+void *runtime_thread(void *arg);
+void verify_error(vm_program *program, int index, const char *message);
+int check_target(vm_program *program, int index, int m);
+int ancestor(vm_program *program, int entry, int l);
+void verify_procedure(vm_program *program, int entry, int *work, int *procs, int *num_procs_found);
+int total_need(vm_program *program, int entry, int *state, int *total);
+int verify_program(vm_program *program);
+void load_map(char *file_name);
+void grow_procedure_tables(int count);
+void enter_procedure(int proc);
+void leave_procedure();
+void write_profile(char *source_file_name);
+void print_opcode_mix();
+
+#ifndef VM_LIBRARY
+int main(int argc, char *argv[])
+{
+  int argi = 1, threads = 0, runs = 0;
+  long long budget = 0;
+  char *map_file_name = NULL, *source_file_name = NULL;
+  while (argi < argc && argv[argi][0] == '-')
+  {
+    if (strcmp(argv[argi], "-c") == 0)
+      count_instructions = 1;
+    else if (strcmp(argv[argi], "-m") == 0)
+      opcode_mix = 1;
+    else if (strcmp(argv[argi], "-p") == 0 && argi + 2 < argc)
+    {
+      profiling = 1;
+      map_file_name = argv[++argi];
+      source_file_name = argv[++argi];
+    }
+    else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc)
+      threads = atoi(argv[++argi]);
+    else if (strcmp(argv[argi], "-n") == 0 && argi + 1 < argc)
+      runs = atoi(argv[++argi]);
+    else if (strcmp(argv[argi], "-b") == 0 && argi + 1 < argc)
+      budget = atoll(argv[++argi]);
+    else
+    {
+      printf("Unknown option %s\n", argv[argi]);
+      return 1;
+    }
+    argi++;
+  }
+
+  if ((threads > 0 ? argc - argi < 1 : argc - argi != 1) || threads < 0 || runs < 0 || budget < 0 ||
+      (runs > 0 && threads == 0) || ((profiling || opcode_mix) && (threads > 0 || budget > 0)))
+  {
+    printf("Usage: %s [-c] [-m] [-p <map file> <source file> | -b <budget>] <code file>\n", argv[0]);
+    printf("       %s [-c] [-b <budget>] -t <threads> [-n <runs>] <code file>...\n", argv[0]);
+    return 1;
+  }
+
+  if (threads > 0)
+    return run_batch(threads, runs > 0 ? runs : 1, budget, argc - argi, argv + argi);
+
+  char error[VM_ERROR_LENGTH];
+  vm_program *program = vm_load(argv[argi], error, sizeof(error));
+  if (program == NULL)
+  {
+    printf("%s\n", error);
+    return 1;
+  }
+  if (profiling || opcode_mix)
+  {
+    console.input = stdin;
+    console.output = stdout;
+    code = program->code;
+    code_length = program->length;
+    stack_size = program->stack_size;
+    stack = calloc(stack_size, sizeof(int));
+    if (stack == NULL)
+      vm_error("out of memory allocating stack");
+    if (profiling)
+    {
+      load_map(map_file_name);
+      enter_procedure(0); // main
+    }
+    else
+      instruction_count = calloc(code_length, sizeof(long long));
+    run();
+    vm_flush(&console);
+  }
+  else
+  {
+    vm_execution *execution = vm_new_execution(program, NULL, budget);
+    if (execution == NULL)
+    {
+      printf("Error: out of memory\n");
+      return 1;
+    }
+    execution->input = stdin;
+    execution->output = stdout;
+    if (vm_run(execution, 0) == vm_failed)
+    {
+      printf("%s\n", execution->error);
+      return 1;
+    }
+    executed = execution->executed;
+  }
+
+  if (count_instructions)
+    fprintf(stderr, "Instructions executed: %lld\n", executed);
+  if (opcode_mix)
+    print_opcode_mix();
+  if (profiling)
+  {
+    while (num_frames > 0)
+      leave_procedure();
+    write_profile(source_file_name);
+  }
+  return 0;
+}
+
+// Load each code file once and run it runs times on a pool of threads. Every execution reads all of
+// standard input from memory, and the outputs are printed in order once all have finished.
+int run_batch(int threads, int runs, long long budget, int num_files, char *file_names[])
+{
+  char error[VM_ERROR_LENGTH];
+  char *input = read_text(stdin);
+  vm_program **programs = malloc(sizeof(vm_program *) * num_files);
+  vm_execution **executions = malloc(sizeof(vm_execution *) * num_files * runs);
+  if (input == NULL || programs == NULL || executions == NULL)
+  {
+    printf("Error: out of memory\n");
+    return 1;
+  }
+  for (int f = 0; f < num_files; f++)
+    if ((programs[f] = vm_load(file_names[f], error, sizeof(error))) == NULL)
+    {
+      printf("%s\n", error);
+      return 1;
+    }
+
+  vm_runtime *runtime = vm_start(threads, TIME_SLICE);
+  if (runtime == NULL)
+  {
+    printf("Error: could not start %d threads\n", threads);
+    return 1;
+  }
+  for (int i = 0; i < num_files * runs; i++)
+  {
+    executions[i] = vm_new_execution(programs[i / runs], input, budget);
+    if (executions[i] == NULL)
+    {
+      printf("Error: out of memory\n");
+      return 1;
+    }
+    vm_submit(runtime, executions[i]);
+  }
+  vm_wait_all(runtime);
+  vm_stop(runtime);
+
+  int status = 0;
+  for (int i = 0; i < num_files * runs; i++)
+  {
+    fwrite(executions[i]->output_text, 1, executions[i]->output_length, stdout);
+    if (executions[i]->status == vm_failed)
+    {
+      printf("%s\n", executions[i]->error);
+      status = 1;
+    }
+    executed += executions[i]->executed;
+    vm_free_execution(executions[i]);
+  }
+  if (count_instructions)
+    fprintf(stderr, "Instructions executed: %lld\n", executed);
+
+  for (int f = 0; f < num_files; f++)
+    vm_free_program(programs[f]);
+  free(programs);
+  free(executions);
+  free(input);
+  return status;
+}
+
+// Read the rest of a file into a new null-terminated buffer
+char *read_text(FILE *f)
+{
+  long length = 0, capacity = 4096;
+  char *text = malloc(capacity);
+  size_t n;
+  while (text != NULL && (n = fread(text + length, 1, capacity - length - 1, f)) > 0)
+  {
+    length += n;
+    if (length == capacity - 1)
+    {
+      capacity *= 2;
+      text = realloc(text, capacity);
+    }
+  }
+  if (text != NULL)
+    text[length] = '\0';
+  return text;
+}
+#endif
+
+// Read "op l m" triples from the code file written by the compiler and verify them
+vm_program *vm_load(const char *file_name, char *error, int error_size)
+{
+  FILE *code_file = fopen(file_name, "r");
+  if (code_file == NULL)
+  {
+    snprintf(error, error_size, "Error: Could not open code file %s", file_name);
+    return NULL;
+  }
+  vm_program *program = calloc(1, sizeof(vm_program));
+  if (program == NULL)
+  {
+    snprintf(error, error_size, "Error: out of memory loading program");
+    fclose(code_file);
+    return NULL;
+  }
+  pthread_mutex_init(&program->lock, NULL);
+
+  int capacity = 0;
+  instruction ir;
+  while (fscanf(code_file, "%d %d %d", &ir.op, &ir.l, &ir.m) == 3)
+  {
+    if (program->length == capacity)
+    {
+      capacity = capacity == 0 ? 512 : capacity * 2;
+      instruction *grown = realloc(program->code, sizeof(instruction) * capacity);
+      if (grown == NULL)
+      {
+        snprintf(program->error, sizeof(program->error), "Error: out of memory loading program");
+        break;
+      }
+      program->code = grown;
+    }
+    program->code[program->length++] = ir;
+  }
+  fclose(code_file);
+
+  if (program->error[0] != '\0' || !verify_program(program))
+  {
+    snprintf(error, error_size, "%s", program->error);
+    vm_free_program(program);
+    return NULL;
+  }
+  return program;
+}
+
+// Free a program and its pool of stacks, once no execution of it remains
+void vm_free_program(vm_program *program)
+{
+  for (int i = 0; i < program->num_free_stacks; i++)
+    free(program->free_stacks[i]);
+  free(program->free_stacks);
+  free(program->code);
+  free(program->proc_of);
+  free(program->depth_at);
+  free(program->entry_level);
+  free(program->entry_parent);
+  free(program->frame_need);
+  pthread_mutex_destroy(&program->lock);
+  free(program);
+}
+
+vm_execution *vm_new_execution(vm_program *program, const char *input, long long budget)
+{
+  vm_execution *execution = calloc(1, sizeof(vm_execution));
+  if (execution == NULL)
+    return NULL;
+  execution->program = program;
+  execution->sp = -1;
+  execution->budget = budget;
+  execution->status = vm_running;
+  execution->input_text = input;
+  return execution;
+}
+
+void vm_free_execution(vm_execution *execution)
+{
+  release_stack(execution);
+  free(execution->output_text);
+  free(execution->write_buffer);
+  free(execution->read_buffer);
+  free(execution);
+}
+
+// Follow the static link chain l levels down from the current activation record
+int base(int l)
+{
+  int b = bp;
+  while (l > 0)
+  {
+    if (b < 0 || b > sp)
+      vm_error("invalid static link");
+    b = stack[b];
+    l--;
+  }
+  return b;
+}
+
+// Push a value onto the runtime stack
+void push(int value)
+{
+  if (sp + 1 >= stack_size)
+    vm_error("stack overflow");
+  stack[++sp] = value;
+}
+
+// Pop a value off the runtime stack
+int pop()
+{
+  if (sp < 0)
+    vm_error("stack underflow");
+  return stack[sp--];
+}
+
+// Fetch, decode, and execute until the program halts
+void run()
+{
+  int halt = 0;
+  while (!halt)
+  {
+    if (pc < 0 || pc >= code_length)
+      vm_error("program counter out of range");
+
+    if (instruction_count != NULL)
+      instruction_count[pc]++;
+    if (profiling)
+      nodes[frames[num_frames - 1].node].count++;
+    instruction ir = code[pc++];
+    executed++;
+
+    int a, b;
+    switch (ir.op)
+    {
+    case 1: // LIT
+      push(ir.m);
+      break;
+    case 2: // OPR
+      if (ir.m == 0) // RTN
+      {
+        sp = bp - 1;
+        bp = stack[sp + 2];
+        pc = stack[sp + 3];
+        if (profiling)
+          leave_procedure();
+        break;
+      }
+      if (ir.m == 11) // ODD
+      {
+        push(pop() % 2 != 0);
+        break;
+      }
+      b = pop();
+      a = pop();
+      switch (ir.m)
+      {
+      case 1: // ADD
+        push(a + b);
+        break;
+      case 2: // SUB
+        push(a - b);
+        break;
+      case 3: // MUL
+        push(a * b);
+        break;
+      case 4: // DIV
+        if (b == 0)
+          vm_error("division by zero");
+        if (a == INT_MIN && b == -1) // The quotient does not fit in an int
+          vm_error("division overflow");
+        push(a / b);
+        break;
+      case 5: // EQL
+        push(a == b);
+        break;
+      case 6: // NEQ
+        push(a != b);
+        break;
+      case 7: // LSS
+        push(a < b);
+        break;
+      case 8: // LEQ
+        push(a <= b);
+        break;
+      case 9: // GTR
+        push(a > b);
+        break;
+      case 10: // GEQ
+        push(a >= b);
+        break;
+      default:
+        vm_error("invalid OPR instruction");
+      }
+      break;
+    case 3: // LOD
+      push(stack[base(ir.l) + ir.m]);
+      break;
+    case 4: // STO
+      a = pop();
+      stack[base(ir.l) + ir.m] = a;
+      break;
+    case 5: // CAL
+      if (sp + 3 >= stack_size)
+        vm_error("stack overflow");
+      stack[sp + 1] = base(ir.l); // Static link
+      stack[sp + 2] = bp;         // Dynamic link
+      stack[sp + 3] = pc;         // Return address
+      bp = sp + 1;
+      pc = ir.m / 3;
+      if (profiling)
+        enter_procedure(code_proc[pc]);
+      break;
+    case 6: // INC
+      if (sp + ir.m >= stack_size)
+        vm_error("stack overflow");
+      sp += ir.m;
+      break;
+    case 7: // JMP
+      pc = ir.m / 3;
+      break;
+    case 8: // JPC
+      if (pop() == 0)
+        pc = ir.m / 3;
+      break;
+    case 9: // SYS
+      if (ir.m == 1)
+      {
+        if (!write_output(&console, pop()))
+          vm_error("could not write output");
+      }
+      else if (ir.m == 2)
+      {
+        if (!read_input(&console, &a))
+          vm_error("could not read integer input");
+        push(a);
+      }
+      else if (ir.m == 3)
+        halt = 1;
+      else
+        vm_error("invalid SYS instruction");
+      break;
+    case 10: // LAS: pop value and add it to the variable at L, M
+      a = pop();
+      stack[base(ir.l) + ir.m] += a;
+      break;
+    case 11: // INV: increment the variable at L, M
+      stack[base(ir.l) + ir.m]++;
+      break;
+    case 12: // CEQ: pop value, jump to M unless it equals literal L
+      if (!(pop() == ir.l))
+        pc = ir.m / 3;
+      break;
+    case 13: // CNE
+      if (!(pop() != ir.l))
+        pc = ir.m / 3;
+      break;
+    case 14: // CLT
+      if (!(pop() < ir.l))
+        pc = ir.m / 3;
+      break;
+    case 15: // CLE
+      if (!(pop() <= ir.l))
+        pc = ir.m / 3;
+      break;
+    case 16: // CGT
+      if (!(pop() > ir.l))
+        pc = ir.m / 3;
+      break;
+    case 17: // CGE
+      if (!(pop() >= ir.l))
+        pc = ir.m / 3;
+      break;
+    case 18: // SHL: multiply the top of the stack by 2^M
+      push((int)((unsigned)pop() << ir.m));
+      break;
+    case 19: // SHR: divide the top of the stack by 2^M, truncating toward zero like DIV
+      a = pop();
+      push((a + ((a >> 31) & ((1 << ir.m) - 1))) >> ir.m);
+      break;
+    case 20: // BIT: replace the top of the stack with its bit M
+      push((pop() >> ir.m) & 1);
+      break;
+    case 21: // TCL: call in tail position, replacing the current activation record
+      a = base(ir.l);
+      sp = bp - 1;   // Discard the caller's locals
+      stack[bp] = a; // New static link; dynamic link and return address stay the caller's
+      pc = ir.m / 3;
+      if (profiling)
+      {
+        leave_procedure();
+        enter_procedure(code_proc[pc]);
+      }
+      break;
+    default:
+      vm_error("invalid opcode");
+    }
+  }
+}
+
+// Fetch, decode, and execute a verified program for up to slice instructions. The verifier has
+// proven every jump target, stack access and static link walk safe, so only division by zero or
+// overflow, input, the instruction budget, and (for recursive programs) whether a callee's frame
+// fits are checked.
+vm_status vm_run(vm_execution *execution, long long slice)
+{
+  vm_program *program = execution->program;
+  if (execution->status != vm_running)
+    return execution->status;
+  if (execution->stack == NULL && (execution->stack = acquire_stack(program)) == NULL)
+    return fail_execution(execution, execution->pc, 0, "out of memory allocating stack");
+
+  instruction *code = program->code;
+  int *frame_need = program->frame_need;
+  int check_calls = program->check_calls, stack_size = program->stack_size;
+  int *s = execution->stack;
+  int p = execution->pc, b = execution->bp, t = execution->sp; // Local copies of the registers
+  long long limit = slice > 0 ? slice : LLONG_MAX;
+  if (execution->budget > 0 && execution->budget - execution->executed < limit)
+    limit = execution->budget - execution->executed;
+  long long left = limit; // Instructions this slice may still dispatch
+  int a, c;
+
+  for (;;)
+  {
+    if (left-- == 0)
+    {
+      if (execution->executed + limit == execution->budget)
+        return fail_execution(execution, p, limit, "instruction budget exhausted");
+      execution->pc = p;
+      execution->bp = b;
+      execution->sp = t;
+      execution->executed += limit;
+      return vm_running;
+    }
+    instruction ir = code[p++];
+    switch (ir.op)
+    {
+    case 1: // LIT
+      s[++t] = ir.m;
+      break;
+    case 2: // OPR
+      switch (ir.m)
+      {
+      case 0: // RTN
+        t = b - 1;
+        p = s[t + 3];
+        b = s[t + 2];
+        break;
+      case 1: // ADD
+        t--;
+        s[t] = s[t] + s[t + 1];
+        break;
+      case 2: // SUB
+        t--;
+        s[t] = s[t] - s[t + 1];
+        break;
+      case 3: // MUL
+        t--;
+        s[t] = s[t] * s[t + 1];
+        break;
+      case 4: // DIV
+        t--;
+        if (s[t + 1] == 0)
+          return fail_execution(execution, p - 1, limit - left, "division by zero");
+        if (s[t] == INT_MIN && s[t + 1] == -1) // The quotient does not fit in an int
+          return fail_execution(execution, p - 1, limit - left, "division overflow");
+        s[t] = s[t] / s[t + 1];
+        break;
+      case 5: // EQL
+        t--;
+        s[t] = s[t] == s[t + 1];
+        break;
+      case 6: // NEQ
+        t--;
+        s[t] = s[t] != s[t + 1];
+        break;
+      case 7: // LSS
+        t--;
+        s[t] = s[t] < s[t + 1];
+        break;
+      case 8: // LEQ
+        t--;
+        s[t] = s[t] <= s[t + 1];
+        break;
+      case 9: // GTR
+        t--;
+        s[t] = s[t] > s[t + 1];
+        break;
+      case 10: // GEQ
+        t--;
+        s[t] = s[t] >= s[t + 1];
+        break;
+      case 11: // ODD
+        s[t] = s[t] % 2 != 0;
+        break;
+      }
+      break;
+    case 3: // LOD
+      for (a = b, c = ir.l; c > 0; c--)
+        a = s[a];
+      s[++t] = s[a + ir.m];
+      break;
+    case 4: // STO
+      for (a = b, c = ir.l; c > 0; c--)
+        a = s[a];
+      s[a + ir.m] = s[t--];
+      break;
+    case 5: // CAL
+      for (a = b, c = ir.l; c > 0; c--)
+        a = s[a];
+      if (check_calls && t + 1 + frame_need[ir.m / 3] > stack_size)
+        return fail_execution(execution, p - 1, limit - left, "stack overflow");
+      s[t + 1] = a; // Static link
+      s[t + 2] = b; // Dynamic link
+      s[t + 3] = p; // Return address
+      b = t + 1;
+      p = ir.m / 3;
+      break;
+    case 6: // INC
+      t += ir.m;
+      break;
+    case 7: // JMP
+      p = ir.m / 3;
+      break;
+    case 8: // JPC
+      if (s[t--] == 0)
+        p = ir.m / 3;
+      break;
+    case 9: // SYS
+      if (ir.m == 1)
+      {
+        if (!write_output(execution, s[t--]))
+          return fail_execution(execution, p - 1, limit - left, "could not write output");
+      }
+      else if (ir.m == 2)
+      {
+        if (!read_input(execution, &a))
+          return fail_execution(execution, p - 1, limit - left, "could not read integer input");
+        s[++t] = a;
+      }
+      else
+      {
+        if (!vm_flush(execution))
+          return fail_execution(execution, p - 1, limit - left, "could not write output");
+        execution->pc = p;
+        execution->bp = b;
+        execution->sp = t;
+        execution->executed += limit - left;
+        execution->status = vm_halted;
+        release_stack(execution);
+        return vm_halted;
+      }
+      break;
+    case 10: // LAS
+      for (a = b, c = ir.l; c > 0; c--)
+        a = s[a];
+      s[a + ir.m] += s[t--];
+      break;
+    case 11: // INV
+      for (a = b, c = ir.l; c > 0; c--)
+        a = s[a];
+      s[a + ir.m]++;
+      break;
+    case 12: // CEQ
+      if (!(s[t--] == ir.l))
+        p = ir.m / 3;
+      break;
+    case 13: // CNE
+      if (!(s[t--] != ir.l))
+        p = ir.m / 3;
+      break;
+    case 14: // CLT
+      if (!(s[t--] < ir.l))
+        p = ir.m / 3;
+      break;
+    case 15: // CLE
+      if (!(s[t--] <= ir.l))
+        p = ir.m / 3;
+      break;
+    case 16: // CGT
+      if (!(s[t--] > ir.l))
+        p = ir.m / 3;
+      break;
+    case 17: // CGE
+      if (!(s[t--] >= ir.l))
+        p = ir.m / 3;
+      break;
+    case 18: // SHL
+      s[t] = (int)((unsigned)s[t] << ir.m);
+      break;
+    case 19: // SHR
+      a = s[t];
+      s[t] = (a + ((a >> 31) & ((1 << ir.m) - 1))) >> ir.m;
+      break;
+    case 20: // BIT
+      s[t] = (s[t] >> ir.m) & 1;
+      break;
+    case 21: // TCL
+      for (a = b, c = ir.l; c > 0; c--)
+        a = s[a];
+      if (check_calls && b + frame_need[ir.m / 3] > stack_size)
+        return fail_execution(execution, p - 1, limit - left, "stack overflow");
+      t = b - 1;
+      s[b] = a;
+      p = ir.m / 3;
+      break;
+    }
+  }
+}
+
+// Stop an execution with a runtime error at instruction index, after count instructions of this slice
+vm_status fail_execution(vm_execution *execution, int index, long long count, const char *message)
+{
+  vm_flush(execution); // The output written before the error
+  execution->executed += count;
+  execution->status = vm_failed;
+  snprintf(execution->error, sizeof(execution->error), "Runtime error at instruction %d: %s", index, message);
+  release_stack(execution);
+  return vm_failed;
+}
+
+// Write value in decimal and a newline to dest, which must have room for the 12 characters of
+// "-2147483648\n", two digits at a time. Return the number of characters written.
+int format_int(char *dest, int value)
+{
+  static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char text[12];
+  int n = sizeof(text);
+  unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+  text[--n] = '\n';
+  while (u >= 100)
+  {
+    const char *pair = digit_pairs + u % 100 * 2;
+    u /= 100;
+    text[--n] = pair[1];
+    text[--n] = pair[0];
+  }
+  if (u >= 10)
+  {
+    text[--n] = digit_pairs[u * 2 + 1];
+    text[--n] = digit_pairs[u * 2];
+  }
+  else
+    text[--n] = '0' + u;
+  if (value < 0)
+    text[--n] = '-';
+  memcpy(dest, text + n, sizeof(text) - n);
+  return sizeof(text) - n;
+}
+
+// Write an integer line to the execution's output buffer, which goes to its output stream when
+// full, or to its memory buffer
+int write_output(vm_execution *execution, int value)
+{
+  if (execution->output != NULL)
+  {
+    if (execution->write_buffer == NULL && (execution->write_buffer = malloc(VM_IO_BUFFER_SIZE)) == NULL)
+      return 0;
+    if (VM_IO_BUFFER_SIZE - execution->write_length < 12 && !vm_flush(execution))
+      return 0;
+    execution->write_length += format_int(execution->write_buffer + execution->write_length, value);
+    return 1;
+  }
+  if (execution->output_capacity - execution->output_length < 12)
+  {
+    long capacity = execution->output_capacity == 0 ? 256 : execution->output_capacity * 2;
+    char *grown = realloc(execution->output_text, capacity);
+    if (grown == NULL)
+      return 0;
+    execution->output_text = grown;
+    execution->output_capacity = capacity;
+  }
+  execution->output_length += format_int(execution->output_text + execution->output_length, value);
+  return 1;
+}
+
+int vm_flush(vm_execution *execution)
+{
+  long length = execution->write_length;
+  execution->write_length = 0;
+  return length == 0 || fwrite(execution->write_buffer, 1, length, execution->output) == (size_t)length;
+}
+
+// Read another block of the input stream into the read buffer, keeping the unparsed input and
+// growing the buffer if that fills it. Return 0 at the end of the input.
+int fill_input(vm_execution *execution)
+{
+  long kept = execution->read_length - execution->read_pos;
+  memmove(execution->read_buffer, execution->read_buffer + execution->read_pos, kept);
+  execution->read_pos = 0;
+  execution->read_length = kept;
+  if (kept == execution->read_capacity)
+  {
+    char *grown = realloc(execution->read_buffer, execution->read_capacity * 2);
+    if (grown == NULL)
+      return 0;
+    execution->read_buffer = grown;
+    execution->read_capacity *= 2;
+  }
+  size_t n = fread(execution->read_buffer + kept, 1, execution->read_capacity - kept, execution->input);
+  execution->read_length += n;
+  return n > 0;
+}
+
+// Read an integer from the execution's input stream or memory input, as scanf("%d") would. A
+// stream is read a block at a time and parsed from the read buffer, unless it is a terminal.
+int read_input(vm_execution *execution, int *value)
+{
+  if (execution->input != NULL)
+  {
+    if (execution->read_buffer == NULL && !execution->interactive)
+    {
+      execution->interactive = isatty(fileno(execution->input));
+      if (!execution->interactive && (execution->read_buffer = malloc(VM_IO_BUFFER_SIZE)) == NULL)
+        return 0;
+      execution->read_capacity = VM_IO_BUFFER_SIZE;
+    }
+    if (execution->interactive)
+    {
+      vm_flush(execution); // Show any prompt before waiting
+      return fscanf(execution->input, "%d", value) == 1;
+    }
+
+    // Skip whitespace, then make sure the buffer holds the whole number
+    char *text;
+    long i, end;
+    int more = 1;
+    for (;;)
+    {
+      text = execution->read_buffer;
+      for (i = execution->read_pos; i < execution->read_length && text[i] != '\0' && strchr(" \t\n\v\f\r", text[i]); i++)
+        ;
+      execution->read_pos = i;
+      end = i + (i < execution->read_length && (text[i] == '-' || text[i] == '+'));
+      while (end < execution->read_length && text[end] >= '0' && text[end] <= '9')
+        end++;
+      if (end < execution->read_length || !more)
+        break;
+      more = fill_input(execution); // The number may continue in the next block
+    }
+
+    // Convert like strtol(), saturating at the limits of a long, then narrow to int
+    i = execution->read_pos;
+    int negative = i < end && text[i] == '-';
+    i += i < end && (text[i] == '-' || text[i] == '+');
+    if (i == end)
+      return 0;
+    unsigned long long n = 0, limit = negative ? (unsigned long long)LONG_MAX + 1 : LONG_MAX;
+    for (; i < end; i++)
+      n = n > (limit - (text[i] - '0')) / 10 ? limit : n * 10 + (text[i] - '0');
+    execution->read_pos = end;
+    *value = (int)(negative ? (long)(0 - n) : (long)n);
+    return 1;
+  }
+  if (execution->input_text == NULL)
+    return 0;
+  const char *start = execution->input_text + execution->input_pos;
+  char *end;
+  long n = strtol(start, &end, 10);
+  if (end == start)
+    return 0;
+  execution->input_pos += end - start;
+  *value = (int)n;
+  return 1;
+}
+
+// Take a cleared stack from the program's pool, or allocate one if the pool is empty
+int *acquire_stack(vm_program *program)
+{
+  int *stack = NULL;
+  pthread_mutex_lock(&program->lock);
+  if (program->num_free_stacks > 0)
+    stack = program->free_stacks[--program->num_free_stacks];
+  pthread_mutex_unlock(&program->lock);
+  return stack != NULL ? stack : calloc(program->stack_size, sizeof(int));
+}
+
+// Clear a finished execution's stack, so variables start at zero as in a fresh VM, and return it to the pool
+void release_stack(vm_execution *execution)
+{
+  vm_program *program = execution->program;
+  int *stack = execution->stack;
+  if (stack == NULL)
+    return;
+  execution->stack = NULL;
+  memset(stack, 0, sizeof(int) * program->stack_size);
+  pthread_mutex_lock(&program->lock);
+  if (program->num_free_stacks == program->free_stacks_capacity)
+  {
+    int capacity = program->free_stacks_capacity == 0 ? 16 : program->free_stacks_capacity * 2;
+    int **grown = realloc(program->free_stacks, sizeof(int *) * capacity);
+    if (grown != NULL)
+    {
+      program->free_stacks = grown;
+      program->free_stacks_capacity = capacity;
+    }
+  }
+  if (program->num_free_stacks < program->free_stacks_capacity)
+    program->free_stacks[program->num_free_stacks++] = stack;
+  else
+    free(stack);
+  pthread_mutex_unlock(&program->lock);
+}
+
+// Start a pool of threads that run submitted executions
+vm_runtime *vm_start(int threads, long long slice)
+{
+  vm_runtime *runtime = calloc(1, sizeof(vm_runtime));
+  if (runtime == NULL || (runtime->threads = malloc(sizeof(pthread_t) * threads)) == NULL)
+  {
+    free(runtime);
+    return NULL;
+  }
+  runtime->slice = slice;
+  pthread_mutex_init(&runtime->lock, NULL);
+  pthread_cond_init(&runtime->queued, NULL);
+  pthread_cond_init(&runtime->finished, NULL);
+  while (runtime->num_threads < threads &&
+         pthread_create(&runtime->threads[runtime->num_threads], NULL, runtime_thread, runtime) == 0)
+    runtime->num_threads++;
+  if (runtime->num_threads == 0)
+  {
+    vm_stop(runtime);
+    return NULL;
+  }
+  return runtime;
+}
+
+// Queue an execution to run on the runtime's threads
+void vm_submit(vm_runtime *runtime, vm_execution *execution)
+{
+  pthread_mutex_lock(&runtime->lock);
+  execution->done = 0;
+  execution->next = NULL;
+  if (runtime->tail != NULL)
+    runtime->tail->next = execution;
+  else
+    runtime->head = execution;
+  runtime->tail = execution;
+  runtime->unfinished++;
+  pthread_cond_signal(&runtime->queued);
+  pthread_mutex_unlock(&runtime->lock);
+}
+
+// Wait until a submitted execution has halted or failed
+void vm_wait(vm_runtime *runtime, vm_execution *execution)
+{
+  pthread_mutex_lock(&runtime->lock);
+  while (!execution->done)
+    pthread_cond_wait(&runtime->finished, &runtime->lock);
+  pthread_mutex_unlock(&runtime->lock);
+}
+
+// Wait until every submitted execution has halted or failed
+void vm_wait_all(vm_runtime *runtime)
+{
+  pthread_mutex_lock(&runtime->lock);
+  while (runtime->unfinished > 0)
+    pthread_cond_wait(&runtime->finished, &runtime->lock);
+  pthread_mutex_unlock(&runtime->lock);
+}
+
+// Finish the queued executions, then stop the threads and free the runtime
+void vm_stop(vm_runtime *runtime)
+{
+  pthread_mutex_lock(&runtime->lock);
+  runtime->stopping = 1;
+  pthread_cond_broadcast(&runtime->queued);
+  pthread_mutex_unlock(&runtime->lock);
+  for (int i = 0; i < runtime->num_threads; i++)
+    pthread_join(runtime->threads[i], NULL);
+  pthread_cond_destroy(&runtime->queued);
+  pthread_cond_destroy(&runtime->finished);
+  pthread_mutex_destroy(&runtime->lock);
+  free(runtime->threads);
+  free(runtime);
+}
+
+// Take executions off the run queue and run each for one time slice, putting it back at the end
+// of the queue if it has not finished
+void *runtime_thread(void *arg)
+{
+  vm_runtime *runtime = arg;
+  pthread_mutex_lock(&runtime->lock);
+  for (;;)
+  {
+    while (runtime->head == NULL && !runtime->stopping)
+      pthread_cond_wait(&runtime->queued, &runtime->lock);
+    vm_execution *execution = runtime->head;
+    if (execution == NULL)
+      break;
+    runtime->head = execution->next;
+    if (runtime->head == NULL)
+      runtime->tail = NULL;
+    pthread_mutex_unlock(&runtime->lock);
+
+    vm_status status = vm_run(execution, runtime->slice);
+
+    pthread_mutex_lock(&runtime->lock);
+    if (status == vm_running)
+    {
+      execution->next = NULL;
+      if (runtime->tail != NULL)
+        runtime->tail->next = execution;
+      else
+        runtime->head = execution;
+      runtime->tail = execution;
+    }
+    else
+    {
+      execution->done = 1;
+      runtime->unfinished--;
+      pthread_cond_broadcast(&runtime->finished);
+    }
+  }
+  pthread_mutex_unlock(&runtime->lock);
+  return NULL;
+}
+
+// Print a runtime error message and exit
+void vm_error(const char *message)
+{
+  vm_flush(&console); // The output written before the error
+  printf("Runtime error at instruction %d: %s\n", pc - 1, message);
+  exit(1);
+}
+
+// Record a verification error message and return to verify_program()
+void verify_error(vm_program *program, int index, const char *message)
+{
+  snprintf(program->error, sizeof(program->error), "Error: code file failed verification at instruction %d: %s",
+           index, message);
+  longjmp(program->failed, 1);
+}
+
+// Check that M is the address of an instruction, returning its index
+int check_target(vm_program *program, int index, int m)
+{
+  if (m < 0 || m % 3 != 0 || m / 3 >= program->length)
+    verify_error(program, index, "jump or call target out of range or not a multiple of 3");
+  return m / 3;
+}
+
+// Return the entry of the procedure whose frame is l static links up from procedure entry's
+int ancestor(vm_program *program, int entry, int l)
+{
+  while (l-- > 0)
+    entry = program->entry_parent[entry];
+  return entry;
+}
+
+// Follow every path through the procedure entered at entry, assigning each instruction reached the
+// stack depth it runs at. Depths must agree where paths join, pushes and pops must stay above the
+// three link cells, and the static level of each callee must agree between its call sites.
+void verify_procedure(vm_program *program, int entry, int *work, int *procs, int *num_procs_found)
+{
+  int count = 0;
+  program->proc_of[entry] = entry;
+  program->depth_at[entry] = 0;
+  work[count++] = entry;
+  program->frame_need[entry] = 3;
+
+  while (count > 0)
+  {
+    int i = work[--count];
+    instruction ir = program->code[i];
+    int depth = program->depth_at[i];
+    int pops = 0, pushes = 0; // Stack effect
+    int next[2], n = 0;       // Successors in this procedure
+    int falls_through = 1;
+
+    switch (ir.op)
+    {
+    case 1: // LIT
+      pushes = 1;
+      break;
+    case 2: // OPR
+      if (ir.m == 0)
+      {
+        if (entry == 0)
+          verify_error(program, i, "RTN in the main program");
+        falls_through = 0;
+      }
+      else if (ir.m == 11)
+        pops = pushes = 1;
+      else if (ir.m >= 1 && ir.m <= 10)
+        pops = 2, pushes = 1;
+      else
+        verify_error(program, i, "invalid OPR instruction");
+      break;
+    case 3: // LOD
+    case 4: // STO
+    case 10: // LAS
+    case 11: // INV
+      if (ir.l < 0 || ir.l > program->entry_level[entry])
+        verify_error(program, i, "L is deeper than the static nesting");
+      if (ir.m < 3)
+        verify_error(program, i, "variable overlaps the frame links");
+      pops = ir.op == 4 || ir.op == 10;
+      pushes = ir.op == 3;
+      break;
+    case 5: // CAL
+    case 21: // TCL
+    {
+      int callee = check_target(program, i, ir.m);
+      if (ir.l < (ir.op == 21) || ir.l > program->entry_level[entry])
+        verify_error(program, i, "L is deeper than the static nesting");
+      int level = program->entry_level[entry] - ir.l + 1;
+      int parent = ancestor(program, entry, ir.l);
+      if (program->entry_level[callee] == -1)
+      {
+        program->entry_level[callee] = level;
+        program->entry_parent[callee] = parent;
+        procs[(*num_procs_found)++] = callee;
+      }
+      else if (program->entry_level[callee] != level || program->entry_parent[callee] != parent)
+        verify_error(program, i, "procedure is called with different static links");
+      if (depth < 3)
+        verify_error(program, i, "call overwrites the frame links");
+      falls_through = ir.op == 5;
+      break;
+    }
+    case 6: // INC
+      if (ir.m < 0 || ir.m > MAX_STACK_HEIGHT)
+        verify_error(program, i, "invalid INC instruction");
+      if (depth + ir.m > MAX_STACK_HEIGHT)
+        verify_error(program, i, "frame is larger than the stack");
+      pushes = ir.m;
+      break;
+    case 7: // JMP
+      next[n++] = check_target(program, i, ir.m);
+      falls_through = 0;
+      break;
+    case 8: // JPC
+    case 12: // CEQ
+    case 13: // CNE
+    case 14: // CLT
+    case 15: // CLE
+    case 16: // CGT
+    case 17: // CGE
+      next[n++] = check_target(program, i, ir.m);
+      pops = 1;
+      break;
+    case 9: // SYS
+      if (ir.m == 1)
+        pops = 1;
+      else if (ir.m == 2)
+        pushes = 1;
+      else if (ir.m == 3)
+        falls_through = 0;
+      else
+        verify_error(program, i, "invalid SYS instruction");
+      break;
+    case 18: // SHL
+    case 19: // SHR
+    case 20: // BIT
+      if (ir.m < 0 || ir.m > (ir.op == 19 ? 30 : 31))
+        verify_error(program, i, "invalid shift or bit index");
+      pops = pushes = 1;
+      break;
+    default:
+      verify_error(program, i, "invalid opcode");
+    }
+
+    if (depth - pops < 3 && (pops > 0 || (pushes > 0 && ir.op != 6)))
+      verify_error(program, i, pops > 0 ? "stack underflow" : "push overwrites the frame links");
+    depth += pushes - pops;
+    if (depth > program->frame_need[entry])
+      program->frame_need[entry] = depth;
+
+    if (falls_through)
+    {
+      if (i + 1 >= program->length)
+        verify_error(program, i, "execution runs past the end of the code");
+      next[n++] = i + 1;
+    }
+    for (int k = 0; k < n; k++)
+    {
+      int j = next[k];
+      if (program->proc_of[j] == -1)
+      {
+        program->proc_of[j] = entry;
+        program->depth_at[j] = depth;
+        work[count++] = j;
+      }
+      else if (program->proc_of[j] != entry)
+        verify_error(program, i, "jump into another procedure");
+      else if (program->depth_at[j] != depth)
+        verify_error(program, i, "stack depth differs between paths");
+    }
+  }
+}
+
+// Return in total the stack cells a call of the procedure at entry needs, including everything it
+// calls, or 0 if it can recurse. state is 0 before a procedure is visited, 1 while it is on the
+// current call chain, and 2 when done.
+int total_need(vm_program *program, int entry, int *state, int *total)
+{
+  if (state[entry] == 1)
+    return 0; // Recursion
+  if (state[entry] == 2)
+    return total[entry] >= 0;
+  state[entry] = 1;
+  total[entry] = program->frame_need[entry];
+  instruction *code = program->code;
+  int bounded = 1;
+  for (int i = 0; i < program->length && bounded; i++)
+    if (program->proc_of[i] == entry && (code[i].op == 5 || code[i].op == 21))
+    {
+      int callee = code[i].m / 3;
+      bounded = total_need(program, callee, state, total);
+      int need = (code[i].op == 5 ? program->depth_at[i] : 0) + total[callee]; // A tail call reuses this frame
+      if (bounded && need > total[entry])
+        total[entry] = need;
+    }
+  if (!bounded)
+    total[entry] = -1;
+  state[entry] = 2;
+  return bounded;
+}
+
+// Verify the whole program once, before it runs. Find each procedure from main and the calls,
+// check every instruction reachable in it, then check each variable access against the frame of
+// the procedure it reaches. If no procedure can recurse, the stack is sized to exactly what the
+// deepest chain of calls needs and the VM checks nothing at runtime. Return 0 with the message in
+// program->error if the program fails.
+int verify_program(vm_program *program)
+{
+  int length = program->length;
+  instruction *code = program->code;
+  program->stack_size = MAX_STACK_HEIGHT;
+  program->check_calls = 1;
+  program->proc_of = malloc(sizeof(int) * (length + 1));
+  program->depth_at = malloc(sizeof(int) * (length + 1));
+  program->entry_level = malloc(sizeof(int) * (length + 1));
+  program->entry_parent = malloc(sizeof(int) * (length + 1));
+  program->frame_need = malloc(sizeof(int) * (length + 1));
+  int *work = malloc(sizeof(int) * (length + 1));
+  int *procs = malloc(sizeof(int) * (length + 1));
+  int *state = calloc(length + 1, sizeof(int));
+  int *total = malloc(sizeof(int) * (length + 1));
+
+  volatile int verified = 0;
+  if (program->proc_of == NULL || program->depth_at == NULL || program->entry_level == NULL ||
+      program->entry_parent == NULL || program->frame_need == NULL || work == NULL || procs == NULL ||
+      state == NULL || total == NULL)
+    snprintf(program->error, sizeof(program->error), "Error: out of memory verifying program");
+  else if (setjmp(program->failed) == 0)
+  {
+    if (length == 0)
+      verify_error(program, 0, "code file is empty");
+    for (int i = 0; i < length; i++)
+      program->proc_of[i] = program->entry_level[i] = program->entry_parent[i] = -1;
+
+    int num_procs_found = 0;
+    program->entry_level[0] = 0; // Main
+    procs[num_procs_found++] = 0;
+    for (int k = 0; k < num_procs_found; k++)
+    {
+      if (program->proc_of[procs[k]] != -1)
+        verify_error(program, procs[k], "call into the middle of a procedure");
+      verify_procedure(program, procs[k], work, procs, &num_procs_found);
+    }
+
+    for (int i = 0; i < length; i++)
+    {
+      int op = code[i].op;
+      if (program->proc_of[i] != -1 && (op == 3 || op == 4 || op == 10 || op == 11) &&
+          code[i].m >= program->frame_need[ancestor(program, program->proc_of[i], code[i].l)])
+        verify_error(program, i, "variable is outside its frame");
+    }
+
+    if (total_need(program, 0, state, total) && total[0] <= MAX_STACK_HEIGHT)
+    {
+      program->stack_size = total[0] > 0 ? total[0] : 1;
+      program->check_calls = 0;
+    }
+    verified = 1;
+  }
+  free(state);
+  free(total);
+  free(work);
+  free(procs);
+  return verified;
+}
+
+// Read the per-instruction source lines and procedures written by the compiler's -g option
+void load_map(char *file_name)
+{
+  FILE *map_file = fopen(file_name, "r");
+  if (map_file == NULL)
+  {
+    printf("Error: Could not open map file %s\n", file_name);
+    exit(1);
+  }
+
+  code_line = calloc(code_length, sizeof(int));
+  code_proc = calloc(code_length, sizeof(int));
+  instruction_count = calloc(code_length, sizeof(long long));
+
+  char line[64];
+  int entries = 0;
+  while (fgets(line, sizeof(line), map_file) != NULL)
+  {
+    int id;
+    char name[MAX_NAME_LENGTH + 1];
+    if (sscanf(line, "proc %d %11s", &id, name) == 2)
+    {
+      if (id < 0)
+        vm_error("invalid procedure in map file");
+      if (id >= proc_capacity)
+        grow_procedure_tables(id + 1);
+      strcpy(proc_names[id], name);
+      if (id >= num_procs)
+        num_procs = id + 1;
+    }
+    else if (entries < code_length && sscanf(line, "%d %d", &code_line[entries], &code_proc[entries]) == 2)
+      entries++;
+  }
+  fclose(map_file);
+
+  if (entries != code_length)
+    vm_error("map file does not match code file");
+  for (int i = 0; i < code_length; i++)
+    if (code_proc[i] < 0 || code_proc[i] >= num_procs)
+      vm_error("invalid procedure in map file");
+}
+
+// Make room for count procedures in the profile tables, with the new entries empty
+void grow_procedure_tables(int count)
+{
+  int old = proc_capacity;
+  while (proc_capacity < count)
+    proc_capacity = proc_capacity == 0 ? 64 : proc_capacity * 2;
+  proc_names = realloc(proc_names, sizeof(*proc_names) * proc_capacity);
+  proc_calls = realloc(proc_calls, sizeof(long long) * proc_capacity);
+  proc_inclusive = realloc(proc_inclusive, sizeof(long long) * proc_capacity);
+  proc_active = realloc(proc_active, sizeof(int) * proc_capacity);
+  memset(proc_names + old, 0, sizeof(*proc_names) * (proc_capacity - old));
+  memset(proc_calls + old, 0, sizeof(long long) * (proc_capacity - old));
+  memset(proc_inclusive + old, 0, sizeof(long long) * (proc_capacity - old));
+  memset(proc_active + old, 0, sizeof(int) * (proc_capacity - old));
+}
+
+// Record entry into proc on the shadow call stack
+void enter_procedure(int proc)
+{
+  if (num_frames == frames_capacity)
+  {
+    frames_capacity = frames_capacity == 0 ? 64 : frames_capacity * 2;
+    frames = realloc(frames, sizeof(frame) * frames_capacity);
+  }
+
+  // Find or add the trie node for the caller's stack extended by proc
+  int parent = num_frames > 0 ? frames[num_frames - 1].node : -1;
+  int node = parent >= 0 ? nodes[parent].first_child : (num_nodes > 0 ? 0 : -1);
+  while (node >= 0 && nodes[node].proc != proc)
+    node = nodes[node].next_sibling;
+  if (node < 0)
+  {
+    if (num_nodes == nodes_capacity)
+    {
+      nodes_capacity = nodes_capacity == 0 ? 64 : nodes_capacity * 2;
+      nodes = realloc(nodes, sizeof(stack_node) * nodes_capacity);
+    }
+    node = num_nodes++;
+    nodes[node].proc = proc;
+    nodes[node].parent = parent;
+    nodes[node].first_child = -1;
+    nodes[node].count = 0;
+    nodes[node].next_sibling = parent >= 0 ? nodes[parent].first_child : -1;
+    if (parent >= 0)
+      nodes[parent].first_child = node;
+  }
+
+  frames[num_frames].proc = proc;
+  frames[num_frames].node = node;
+  frames[num_frames].entry = proc_active[proc]++ == 0 ? executed : -1; // Count recursion once
+  num_frames++;
+  proc_calls[proc]++;
+}
+
+// Record return from the innermost procedure on the shadow call stack
+void leave_procedure()
+{
+  frame f = frames[--num_frames];
+  proc_active[f.proc]--;
+  if (f.entry >= 0)
+    proc_inclusive[f.proc] += executed - f.entry;
+}
+
+// Print the call stack of a trie node as semicolon separated procedure names
+void print_stack(FILE *file, int node)
+{
+  if (nodes[node].parent >= 0)
+  {
+    print_stack(file, nodes[node].parent);
+    fprintf(file, ";");
+  }
+  fprintf(file, "%s", proc_names[nodes[node].proc]);
+}
+
+// Write profile.txt (procedure table, annotated source, instruction counts) and profile.folded (collapsed stacks)
+void write_profile(char *source_file_name)
+{
+  FILE *report = fopen("profile.txt", "w");
+  FILE *folded = fopen("profile.folded", "w");
+  FILE *source = fopen(source_file_name, "r");
+  if (report == NULL || folded == NULL || source == NULL)
+  {
+    printf("Error: Could not write profile for %s\n", source_file_name);
+    exit(1);
+  }
+
+  long long *exclusive = calloc(num_procs, sizeof(long long));
+  int max_line = 0;
+  for (int i = 0; i < code_length; i++)
+  {
+    exclusive[code_proc[i]] += instruction_count[i];
+    if (code_line[i] > max_line)
+      max_line = code_line[i];
+  }
+
+  fprintf(report, "Instructions executed: %lld\n\n", executed);
+  fprintf(report, "Procedure Profile:\n");
+  fprintf(report, "%12s %12s %12s %12s\n", "Procedure", "Calls", "Exclusive", "Inclusive");
+  for (int p = 0; p < num_procs; p++)
+    fprintf(report, "%12s %12lld %12lld %12lld\n", proc_names[p], proc_calls[p], exclusive[p], proc_inclusive[p]);
+
+  long long *line_count = calloc(max_line + 1, sizeof(long long));
+  for (int i = 0; i < code_length; i++)
+    line_count[code_line[i]] += instruction_count[i];
+
+  fprintf(report, "\nAnnotated Source (* marks lines with at least %d%% of executed instructions):\n", HOT_LINE_PERCENT);
+  int c, line = 1, at_line_start = 1;
+  while ((c = fgetc(source)) != EOF)
+  {
+    if (at_line_start)
+    {
+      long long count = line <= max_line ? line_count[line] : 0;
+      int hot = executed > 0 && count * 100 >= executed * HOT_LINE_PERCENT;
+      fprintf(report, "%c %12lld %5d | ", hot ? '*' : ' ', count, line);
+      at_line_start = 0;
+    }
+    fputc(c, report);
+    if (c == '\n')
+    {
+      line++;
+      at_line_start = 1;
+    }
+  }
+  if (!at_line_start)
+    fputc('\n', report);
+
+  fprintf(report, "\nInstruction Profile:\n");
+  fprintf(report, "%6s %4s %11s %11s %12s %5s\n", "Index", "OP", "L", "M", "Count", "Line");
+  for (int i = 0; i < code_length; i++)
+    if (instruction_count[i] > 0)
+      fprintf(report, "%6d %4d %11d %11d %12lld %5d\n", i, code[i].op, code[i].l, code[i].m, instruction_count[i], code_line[i]);
+
+  for (int n = 0; n < num_nodes; n++)
+    if (nodes[n].count > 0)
+    {
+      print_stack(folded, n);
+      fprintf(folded, " %lld\n", nodes[n].count);
+    }
+
+  free(exclusive);
+  free(line_count);
+  fclose(source);
+  fclose(folded);
+  fclose(report);
+}
+
+// Print how many times instructions of each opcode were executed, for comparing the dynamic cost of
+// code generated at different optimization levels
+void print_opcode_mix()
+{
+  long long count[32] = {0};
+  for (int i = 0; i < code_length; i++)
+    count[code[i].op & 31] += instruction_count[i];
+  fprintf(stderr, "Opcode Mix:\n");
+  fprintf(stderr, "%4s %12s\n", "OP", "Count");
+  for (int op = 0; op < 32; op++)
+    if (count[op] > 0)
+      fprintf(stderr, "%4d %12lld\n", op, count[op]);
+}
@@ -0,0 +1,116 @@
+/*
+    COP 3402 Systems Software
+    PM/0 Virtual Machine Runtime
+    Authored by Caleb Rivera and Matthew Labrada
+*/
+
+#ifndef VM_H
+#define VM_H
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#define VM_ERROR_LENGTH 128
+#define VM_IO_BUFFER_SIZE 65536 // Bytes of stream input read, or output written, at a time
+
+typedef struct
+{
+  int op; // opcode
+  int l;  // L
+  int m;  // M
+} instruction;
+
+// A loaded and verified program. Its code and verifier results are shared read-only by every
+// execution of it, on any thread.
+typedef struct
+{
+  instruction *code;    // Loaded instructions
+  int length;           // Number of loaded instructions
+  int *proc_of;         // Entry of the procedure each instruction belongs to, -1 if unreachable
+  int *depth_at;        // Stack cells in use above the frame base before each instruction
+  int *entry_level;     // Static nesting level of the procedure entered at each index, or -1
+  int *entry_parent;    // Entry of the statically enclosing procedure, by entry index
+  int *frame_need;      // Stack cells the procedure's own frame needs, by entry index
+  int stack_size;       // Cells each execution's stack needs
+  int check_calls;      // Check that each callee's frame fits (recursive or very deep programs)
+  int **free_stacks;    // Cleared stacks of finished executions, ready for reuse
+  int num_free_stacks;
+  int free_stacks_capacity;
+  pthread_mutex_t lock; // Guards free_stacks
+  jmp_buf failed;       // Where verification errors return to
+  char error[VM_ERROR_LENGTH];
+} vm_program;
+
+// Status of an execution
+typedef enum
+{
+  vm_running, // Not finished yet, possibly paused at the end of a time slice
+  vm_halted,  // Reached SYS 3
+  vm_failed   // Stopped by a runtime error or its instruction budget, see error
+} vm_status;
+
+// One run of a program, with its own stack and I/O
+typedef struct vm_execution
+{
+  vm_program *program;
+  int *stack;                // Taken from the program's pool when the execution first runs
+  int pc, bp, sp;            // Registers, saved between time slices
+  long long executed;        // Instructions dispatched so far
+  long long budget;          // Most instructions the execution may dispatch, 0 for no limit
+  vm_status status;
+  FILE *input, *output;      // Streams for SYS reads and writes, NULL to use the memory buffers
+  const char *input_text;    // Memory input, integers separated by whitespace
+  long input_pos;
+  char *output_text;         // Memory output, one line per written integer
+  long output_length;
+  long output_capacity;
+  char *write_buffer;        // Output not yet written to the output stream
+  long write_length;
+  char *read_buffer;         // Input read from the input stream but not yet parsed
+  long read_pos, read_length;
+  long read_capacity;
+  int interactive;           // Input stream is a terminal: read it a number at a time, after flushing output
+  char error[VM_ERROR_LENGTH]; // Runtime error message when failed
+  int done;                  // Set under the runtime lock once the execution has finished
+  struct vm_execution *next; // Run queue link
+} vm_execution;
+
+// A pool of threads that runs submitted executions, round robin in time slices
+typedef struct
+{
+  pthread_t *threads;
+  int num_threads;
+  long long slice;         // Instructions an execution runs before going to the back of the queue, 0 for no limit
+  pthread_mutex_t lock;    // Guards everything below
+  pthread_cond_t queued;   // Signaled when an execution is queued or the runtime stops
+  pthread_cond_t finished; // Broadcast when an execution finishes
+  vm_execution *head;      // Run queue
+  vm_execution *tail;
+  int unfinished;          // Submitted executions that have not finished
+  int stopping;
+} vm_runtime;
+
+// Load and verify a code file. On failure, return NULL with the message in error.
+vm_program *vm_load(const char *file_name, char *error, int error_size);
+void vm_free_program(vm_program *program);
+
+// Create an execution that reads input (NULL for none) and writes to its memory buffer
+vm_execution *vm_new_execution(vm_program *program, const char *input, long long budget);
+void vm_free_execution(vm_execution *execution);
+
+// Run an execution on the calling thread for up to slice instructions (0 for no limit), returning its status
+vm_status vm_run(vm_execution *execution, long long slice);
+
+// Write an execution's buffered output to its output stream, which happens by itself when the
+// buffer fills and when the execution halts or fails. Return 0 if the stream fails.
+int vm_flush(vm_execution *execution);
+
+// Start a runtime with the given number of threads, submit executions to it, and wait for them
+vm_runtime *vm_start(int threads, long long slice);
+void vm_submit(vm_runtime *runtime, vm_execution *execution);
+void vm_wait(vm_runtime *runtime, vm_execution *execution);
+void vm_wait_all(vm_runtime *runtime);
+void vm_stop(vm_runtime *runtime);
+
+#endif